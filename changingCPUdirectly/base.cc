@@ -70,6 +70,7 @@
 #include "mem/request.hh"
 #include "params/BaseSimpleCPU.hh"
 #include "sim/byteswap.hh"
+#include "sim/core.hh"
 #include "sim/debug.hh"
 #include "sim/faults.hh"
 #include "sim/full_system.hh"
@@ -91,10 +92,79 @@ BaseSimpleCPU::BaseSimpleCPU(const BaseSimpleCPUParams &p)
       traceData(NULL),
       _status(Idle)
 {
-    tc_dm = new traceCache(64,1,16,1);
-    tc_fa = new traceCache(1,64,16,1);
-    tc_sa1 = new traceCache(32,2,16,1);
-    tc_sa2 = new traceCache(16,4,16,1);
+    // all trace caches share one trace builder through the bank. These
+    // geometries map to compile-time specialized models; the fully
+    // associative one probes its whole set with one tag store compare
+    tc_bank = new traceCacheBank(16,1);
+    // with TC_CLASSIFY_MISSES set they run on the general model instead,
+    // which sorts their misses into compulsory/path/capacity/conflict
+    tc_bank->classifyMisses = getenv("TC_CLASSIFY_MISSES") != NULL;
+    // likewise, TC_PROFILE_TRACES=<k> reports their k hottest traces
+    if (const char *k = getenv("TC_PROFILE_TRACES"))
+        tc_bank->profileTraces = atoi(k);
+    tc_dm = tc_bank->addCache(64,1);
+    tc_fa = tc_bank->addCache(1,64);
+    tc_sa1 = tc_bank->addCache(32,2);
+    tc_sa2 = tc_bank->addCache(16,4);
+    // with TC_SKEWED_CACHES set, also model skewed versions of the two
+    // set-associative geometries
+    tc_sk1 = NULL;
+    tc_sk2 = NULL;
+    if (getenv("TC_SKEWED_CACHES")) {
+        tc_sk1 = tc_bank->addCache(new skewedTraceCache(32,2,16,1));
+        tc_sk2 = tc_bank->addCache(new skewedTraceCache(16,4,16,1));
+    }
+
+    // with TC_STATS_FILE=<path>, snapshot the trace cache counters every
+    // TC_STATS_INTERVAL fetches (default 100M) to <path>.<cpu name>, as
+    // JSON if the path ends in .json and as CSV otherwise
+    tc_stats = NULL;
+    if (const char *path = getenv("TC_STATS_FILE")) {
+        std::string file = std::string(path) + "." + name();
+        const char *interval = getenv("TC_STATS_INTERVAL");
+        size_t len = strlen(path);
+        int format = len >= 5 && strcmp(path + len - 5, ".json") == 0 ?
+            TC_STATS_JSON : TC_STATS_CSV;
+        tc_stats = new tcStatsDumper();
+        if (tc_stats->open(file.c_str(), format,
+                interval ? strtoull(interval, NULL, 0) : 100000000) != 0) {
+            delete tc_stats;
+            tc_stats = NULL;
+        }
+        tc_bank->stats = tc_stats;
+    }
+
+    // with TC_WORKER_THREAD set, the bank runs on its own host thread
+    // and preExecute only queues fetches for it
+    tc_worker = NULL;
+    if (getenv("TC_WORKER_THREAD"))
+        tc_worker = new tcBankWorker(tc_bank);
+
+    // with TC_RECORD_TRACE=<path>, also record the fetch stream to
+    // <path>.<cpu name> for replaying offline
+    tc_recorder = NULL;
+    if (const char *path = getenv("TC_RECORD_TRACE")) {
+        std::string file = std::string(path) + "." + name();
+        tc_recorder = new tcFetchRecorder();
+        if (tc_recorder->start(file.c_str()) != 0) {
+            delete tc_recorder;
+            tc_recorder = NULL;
+        }
+    }
+
+    // finish the trace caches and the recording when gem5 exits
+    registerExitCallback([this]() {
+        flushTraceCaches();
+        if (tc_recorder)
+            tc_recorder->stop();
+        if (tc_worker)
+            tc_worker->stop();
+        if (tc_stats) {
+            tc_bank->dumpStats();
+            tc_stats->close();
+        }
+        tc_bank->printCacheState();
+    });
 
     SimpleThread *thread;
 
@@ -193,6 +263,21 @@ BaseSimpleCPU::totalOps() const
 
 BaseSimpleCPU::~BaseSimpleCPU()
 {
+    delete tc_recorder;
+    tc_recorder = NULL;
+    delete tc_worker;
+    tc_worker = NULL;
+    delete tc_stats;
+    tc_stats = NULL;
+}
+
+void
+BaseSimpleCPU::flushTraceCaches()
+{
+    if (tc_worker)
+        tc_worker->flush();
+    else
+        tc_bank->flushFetches();
 }
 
 void
@@ -207,6 +292,7 @@ void
 BaseSimpleCPU::resetStats()
 {
     BaseCPU::resetStats();
+    flushTraceCaches();
     for (auto &thread_info : threadInfo) {
         thread_info->execContextStats.notIdleFraction = (_status != Idle);
     }
@@ -400,22 +486,17 @@ BaseSimpleCPU::preExecute(PacketPtr pkt)
 //        printf("branch prediction: %d\n", predictTakenSave);
 //        printf("is control: %d\n", curStaticInst->isControl());
 
-	// send this request to all trace caches
-	tc_dm->tcInsnFetch(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
-        tc_fa->tcInsnFetch(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
-	tc_sa1->tcInsnFetch(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
-	tc_sa2->tcInsnFetch(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
-
-
-	// print current trace cache state
-	tc_dm->printCacheParameters();
-	tc_dm->printCacheState();
-	tc_fa->printCacheParameters();
-        tc_fa->printCacheState();
-	tc_sa1->printCacheParameters();
-        tc_sa1->printCacheState();
-	tc_sa2->printCacheParameters();
-        tc_sa2->printCacheState();
+	if(tc_recorder)
+	    tc_recorder->record(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
+
+	// queue this request for all trace caches; they run in batches,
+	// on the worker thread if there is one. Stats are written by the
+	// interval dumper, never from here
+	if(tc_worker){
+	    tc_worker->push(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
+	}else{
+	    tc_bank->queueFetch(pkt->getAddr(), curStaticInst->isControl(), predictTakenSave);
+	}
 
     }
    // printf("branch prediction: %d\n", predictTakenSave);
@@ -136,10 +136,18 @@ class BaseSimpleCPU : public BaseCPU
     std::unique_ptr<PCStateBase> preExecuteTempPC;
 
   public:
-    traceCache *tc_dm;
-    traceCache *tc_fa;
-    traceCache *tc_sa1;
-    traceCache *tc_sa2;
+    traceCacheBank *tc_bank;
+    tcModel *tc_dm;
+    tcModel *tc_fa;
+    tcModel *tc_sa1;
+    tcModel *tc_sa2;
+    tcModel *tc_sk1; // NULL unless TC_SKEWED_CACHES is set
+    tcModel *tc_sk2; // NULL unless TC_SKEWED_CACHES is set
+    tcFetchRecorder *tc_recorder; // NULL unless TC_RECORD_TRACE is set
+    tcBankWorker *tc_worker; // NULL unless TC_WORKER_THREAD is set
+    tcStatsDumper *tc_stats; // NULL unless TC_STATS_FILE is set
+    /** Bring the trace cache stats up to date with every fetch so far. */
+    void flushTraceCaches();
     void checkForInterrupts();
     void setupFetchRequest(const RequestPtr &req);
     void serviceInstCountEvents();
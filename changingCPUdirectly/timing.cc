@@ -95,6 +95,9 @@ TimingSimpleCPU::drain()
     // Deschedule any power gating event (if any)
     deschedulePowerGatingEvent();
 
+    // the trace cache stats must cover every fetch before a checkpoint
+    flushTraceCaches();
+
     if (switchedOut())
         return DrainState::Drained;
 
@@ -1,9 +1,39 @@
+#ifndef __TRACECACHE_CC__
+#define __TRACECACHE_CC__
+
 #include <iostream>
+#include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+// storage layouts for the tag side of the trace cache
+enum tcLayout
+{
+    TC_LAYOUT_AOS = 0, // tags are only kept inside the tcLine objects
+    TC_LAYOUT_SOA = 1, // tags, branch flags and valid bits are also kept in
+                       // separate contiguous arrays so a whole set can be
+                       // compared at once
+    TC_LAYOUT_PACKED = 2 // lines are kept as two 64-bit words (tcPackedLine)
+                         // instead of tcLine objects; no partial matching
+};
+
 // represents one line in the trace cache
 class tcLine
 {
@@ -15,6 +45,8 @@ class tcLine
 
     int insnCount; // number of instructions in this line
     int BBCount; // number of basic blocks in this line
+    uint64_t branchMask; // bit i set when instruction i of the line is a
+                         // conditional branch (first 64 instructions)
 
     // Constructor
     tcLine() {
@@ -25,214 +57,3869 @@ class tcLine
       // set fields for building a trace
       this->insnCount = 0;
       this->BBCount = 0;
+      this->branchMask = 0;
     }
 };
 
-// represents the trace cache as an array of tcLine objects
-// This trace cache is currently built to support one branch instruction per
-// trace cache line.
-class traceCache
+// a tcLine squeezed into two 64-bit words, 16 bytes instead of 32. The
+// first word is the tag; the second holds
+//   bit  0      valid
+//   bits 1-10   insnCount (up to 1023)
+//   bits 11-15  BBCount (up to 31)
+//   bits 16-46  branchFlags (one bit per basic block, up to 31)
+// branchMask is not kept, so packed lines cannot serve partial matches.
+class tcPackedLine
 {
   public:
-    // parameters
-    int numSets; // number of sets in the cache
-    int assoc; // associativity of the cache
+    uint64_t tagAddr;
+    uint64_t info;
 
-    // fields describing the trace cache
-    tcLine* line;
-    int    size; // size of the cache in terms of lines
-    int    maxNumInsns; // max number of insns in one cache line
-    int    fetchInsnCount; // counter to count all the fetched instructions
-    int    maxNumBBs = 1; // max number of basic blocks in one cache line
-//    float MissRate;
-    // fields for building a trace in the trace cache
-    int buildingTrace; // 1 = currently building a trace, 0 = otherwise
-    int buildLineIndex; // hold line # is trace cache that trace
-                        // is being built for
-    tcLine* buildLine; // used to hold stats on tc line currently being built
+    static constexpr int insnShift = 1;
+    static constexpr int bbShift = 11;
+    static constexpr int flagShift = 16;
+    static constexpr uint64_t insnMask = 0x3ff;
+    static constexpr uint64_t bbMask = 0x1f;
+    static constexpr uint64_t flagMask = 0x7fffffff;
 
-    // Stats tracking
-    int globalHitCount;
-    int globalMissCount;
+    // Constructor
+    tcPackedLine() {
+        this->tagAddr = 0;
+        this->info = 0;
+    }
+
+    int valid() const { return this->info & 1; }
+    int insnCount() const { return (this->info >> insnShift) & insnMask; }
+    int BBCount() const { return (this->info >> bbShift) & bbMask; }
+    int branchFlags() const { return (this->info >> flagShift) & flagMask; }
+
+    // 1 if this line is valid and holds (fetchAddr, branchPred). The
+    // valid bit and the flags are checked with one compare.
+    int matches(uint64_t fetchAddr, int branchPred) const {
+        uint64_t key = ((uint64_t)(uint32_t)branchPred << flagShift) | 1;
+        uint64_t keyMask = (flagMask << flagShift) | 1;
+        return (this->tagAddr == fetchAddr) & ((this->info & keyMask) == key);
+    }
+
+    void pack(const tcLine &l){
+        this->tagAddr = l.tagAddr;
+        this->info = (uint64_t)(l.valid & 1) |
+                     ((uint64_t)l.insnCount & insnMask) << insnShift |
+                     ((uint64_t)l.BBCount & bbMask) << bbShift |
+                     ((uint64_t)(uint32_t)l.branchFlags & flagMask) << flagShift;
+    }
+
+    tcLine unpack() const {
+        tcLine l;
+        l.tagAddr = this->tagAddr;
+        l.valid = this->valid();
+        l.insnCount = this->insnCount();
+        l.BBCount = this->BBCount();
+        l.branchFlags = this->branchFlags();
+        return l;
+    }
+};
+
+// one instruction fetch, packed to 16 bytes so a batch of them streams
+// through the host caches
+class tcFetchRecord
+{
+  public:
+    uint64_t addr; // fetch address
+    uint8_t  isCondBranch; // 1 = control instruction
+    uint8_t  branchPred; // 1 = predicted taken
+    uint8_t  pad[6];
+};
+static_assert(sizeof(tcFetchRecord) == 16, "fetch records must stay 16 bytes");
+
+// a run of fetches that starts with at most one control instruction. The
+// model only looks at the address of control instructions, so everything
+// after the leading one is just a count. A record with isCondBranch 0
+// continues whatever trace is being built, so a long run may be split
+// across records freely.
+class tcBlockRecord
+{
+  public:
+    uint64_t startPC; // address of the first instruction
+    uint32_t length; // instructions in the run, at least 1
+    uint8_t  isCondBranch; // 1 = the first instruction is a control insn
+    uint8_t  branchPred; // prediction of that instruction
+    uint8_t  pad[2];
+};
+static_assert(sizeof(tcBlockRecord) == 16, "block records must stay 16 bytes");
+
+// collapses n fetch records into block records appended to blocks and
+// returns the number appended. Streams can be converted in chunks.
+inline int tcCollapseBlocks(const tcFetchRecord* records, int n,
+                            vector<tcBlockRecord> &blocks){
+    size_t first = blocks.size();
+    for(int i = 0; i < n; i++){
+        if(records[i].isCondBranch || blocks.size() == first){
+            tcBlockRecord b;
+            b.startPC = records[i].addr;
+            b.length = 1;
+            b.isCondBranch = records[i].isCondBranch;
+            b.branchPred = records[i].branchPred;
+            b.pad[0] = b.pad[1] = 0;
+            blocks.push_back(b);
+        }else{
+            blocks.back().length++;
+        }
+    }
+    return blocks.size() - first;
+}
+
+// fetch records the batch entry points look ahead when prefetching
+static constexpr int tcPrefetchDistance = 16;
+
+// follows the fetch stream and cuts it into traces. Where traces start and
+// end does not depend on what any cache holds, so one builder can feed any
+// number of caches. The sink is told to look up every trace once its key is
+// known (sink.searchTraceCache) and is handed every trace once it is
+// complete (sink.completeTrace).
+//
+// A trace starts at a conditional branch and continues through up to
+// maxNumBBs branches; the prediction of the i-th branch in the trace is bit
+// i of branchFlags. The key is known once the last branch the trace can
+// hold has been fetched, or when the trace ends early on the instruction
+// limit. With one basic block per trace that is the starting branch
+// itself, so the lookup happens right away.
+class traceBuilder
+{
+  public:
+    int maxNumInsns; // max number of insns in one trace
+    int maxNumBBs; // max number of basic blocks in one trace
+    int buildingTrace; // 1 = currently building a trace, 0 = otherwise
+    int lookupPending; // 1 = the trace being built has not been looked up
+    int skippingTrace; // 1 = the sink drops the trace being built, so it
+                       // is only cut, never looked up or completed
+    tcLine buildLine; // the trace currently being built
 
     // Constructor
-    traceCache(int numSets, int assoc, int numInsns, int numBBs) {
-        // create an array of lines
-        line = new tcLine[assoc*numSets];
-        // set tc parameter
-        this->numSets = numSets;
-        this->assoc = assoc;
-        // set tc fields for describing trace cache
-        this->size = assoc*numSets;
+    traceBuilder(int numInsns, int numBBs) {
+        assert(numBBs >= 1 && numBBs <= 31);
         this->maxNumInsns = numInsns;
         this->maxNumBBs = numBBs;
-        // set tc fields for building a trace
         this->buildingTrace = 0;
-        this->buildLineIndex = 0;
-        this->buildLine = new tcLine();
-        // set tc fields for stats tracking
-        this->globalHitCount = 0;
-        this->globalMissCount = 0;
-        this->fetchInsnCount = 0;
-//        this->MissRate = 0;
+        this->lookupPending = 0;
+        this->skippingTrace = 0;
     }
 
     // to be ran every instruction fetch
-    void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred){
-        int traceHit = 0;
-	this->fetchInsnCount++;
-        // conditional branch instructions mark the beginning of a new trace
+    template <class Sink>
+    void step(uint64_t fetchAddr, int isCondBranch, int branchPred, Sink &sink){
         if(isCondBranch){
-            // complete the trace currently being built
-            if(this->buildingTrace){
-                this->completeTrace();
+            if(this->buildingTrace && this->buildLine.BBCount < this->maxNumBBs){
+                // the trace continues through this branch into a new block
+                this->buildLine.branchFlags |= (branchPred & 1) << this->buildLine.BBCount;
+                if(this->buildLine.insnCount < 64){
+                    this->buildLine.branchMask |= 1ULL << this->buildLine.insnCount;
+                }
+                this->buildLine.BBCount++;
+                this->buildLine.insnCount++;
+            }else{
+                // conditional branch instructions mark the beginning of a
+                // new trace; complete the trace currently being built
+                if(this->buildingTrace){
+                    this->completeTrace(sink);
+                }
+                // set up the new trace
+                this->buildLine.tagAddr = fetchAddr; // save the PC
+                this->buildLine.branchFlags = branchPred & 1;
+                this->buildLine.insnCount = 1;
+                this->buildLine.BBCount = 1;
+                this->buildLine.branchMask = 1;
+                this->buildingTrace = 1;
+                this->lookupPending = 1;
+                this->skippingTrace = sink.dropsTrace(fetchAddr, branchPred & 1);
             }
+            // look the trace up once it holds all the branches it can
+            if(this->buildLine.BBCount == this->maxNumBBs){
+                this->searchTraceCache(sink);
+            }
+        }else if(this->buildingTrace){
+            // add this instruction to the trace currently being built
+            this->buildLine.insnCount++;
+        }else{
+            return; // otherwise, do nothing
+        }
 
-            // look for the current address and prediction in the trace cache
-            traceHit = this->searchTraceCache(fetchAddr, branchPred);
+        // check whether the trace has reached its max capacity
+        if(this->buildLine.insnCount >= this->maxNumInsns){
+            this->completeTrace(sink);
+        }
+    }
 
+    // same as calling step on every instruction of the block. The
+    // non-control instructions only add to insnCount, so they are added
+    // in one go, up to the point where the trace is full.
+    template <class Sink>
+    void stepBlock(const tcBlockRecord &block, Sink &sink){
+        uint32_t rest = block.length;
+        if(block.isCondBranch){
+            this->step(block.startPC, 1, block.branchPred, sink);
+            rest--;
+        }
+        if(!this->buildingTrace || rest == 0){
+            return;
+        }
+        uint32_t room = this->maxNumInsns - this->buildLine.insnCount;
+        if(rest >= room){
+            this->buildLine.insnCount = this->maxNumInsns;
+            this->completeTrace(sink);
         }else{
-            if(this->buildingTrace){
-                // if there is a trace currently being built, add this instruction
-                this->buildTrace(fetchAddr, branchPred);
-            } // otherwise, do nothing
+            this->buildLine.insnCount += rest;
         }
     }
 
-    // returns 1 if hit, 0 if miss
-    int searchTraceCache(uint64_t fetchAddr, int branchPred){
-        // get the index bits from the fetch address
-        unsigned int mask = 0;
-        int index = 0;
-        int lowerSearchBound = 0;
-        int upperSearchBound = 0;
-        int numIndexBits = log2(this->numSets);
-        int hit = 0;
-        mask = (1 << numIndexBits) - 1;
-        index = fetchAddr & mask;
+    // same as calling step on each of the n records in order. The records
+    // of a skipped trace go through skipRecords instead.
+    template <class Sink>
+    void stepRecords(const tcFetchRecord* records, int n, Sink &sink){
+        for(int i = 0; i < n; i++){
+            if(this->buildingTrace && this->skippingTrace){
+                i += this->skipRecords(records + i, n - i, sink);
+                if(i == n){
+                    break;
+                }
+            }
+            this->step(records[i].addr, records[i].isCondBranch,
+                       records[i].branchPred, sink);
+        }
+    }
 
-        // find bounds of tc lines to access
-        lowerSearchBound = index * this->assoc;
-        upperSearchBound = lowerSearchBound + this->assoc;
+    // runs the records that only extend a skipped trace and returns how
+    // many. Only the counts that find the end of the trace are kept. Stops
+    // before a branch that starts the next trace, which is left to step,
+    // or once the trace is full.
+    template <class Sink>
+    int skipRecords(const tcFetchRecord* records, int n, Sink &sink){
+        int insnCount = this->buildLine.insnCount;
+        int BBCount = this->buildLine.BBCount;
+        int i = 0;
+        while(i < n && insnCount < this->maxNumInsns){
+            if(records[i].isCondBranch){
+                if(BBCount == this->maxNumBBs){
+                    break;
+                }
+                BBCount++;
+            }
+            insnCount++;
+            i++;
+        }
+        this->buildLine.insnCount = insnCount;
+        this->buildLine.BBCount = BBCount;
+        if(BBCount == this->maxNumBBs){
+            this->searchTraceCache(sink);
+        }
+        if(insnCount >= this->maxNumInsns){
+            this->completeTrace(sink);
+        }
+        return i;
+    }
 
-        // search all lines in appropriate set for hit
-        for(int i = lowerSearchBound; i < upperSearchBound; i++ ){
-            hit = searchTraceLine(fetchAddr, branchPred, i);
-            if(hit){ // if there is a hit, exit early
-                // log the hit statistics
-                this->logHitStats(fetchAddr, branchPred, i);
-                return 1;
+    // runs n block records and returns the number of instructions in them
+    template <class Sink>
+    uint64_t stepBlocks(const tcBlockRecord* blocks, int n, Sink &sink){
+        uint64_t insns = 0;
+        for(int i = 0; i < n; i++){
+            this->stepBlock(blocks[i], sink);
+            insns += blocks[i].length;
+        }
+        return insns;
+    }
+
+    template <class Sink>
+    void searchTraceCache(Sink &sink){
+        if(this->lookupPending){
+            this->lookupPending = 0;
+            if(this->skippingTrace){
+                sink.traceDropped();
+            }else{
+                sink.searchTraceCache(this->buildLine.tagAddr, this->buildLine.branchFlags);
             }
         }
+    }
 
-        // if there is no hit - we have a trace cache miss
-        this->logMissStats(fetchAddr, branchPred);
+    template <class Sink>
+    void completeTrace(Sink &sink){
+        // a trace cut short by the instruction limit is looked up now
+        this->searchTraceCache(sink);
+        if(!this->skippingTrace){
+            this->buildLine.valid = 1;
+            sink.completeTrace(this->buildLine);
+        }
+        this->buildingTrace = 0;
+    }
+};
 
-        // on a miss, we begin building a new trace
-        // first, we figure out in which line the new trace should reside
-        this->buildLineIndex = this->selectBuildLineIndex(lowerSearchBound, upperSearchBound);
-        // then, we begin building the trace
-        this->buildTrace(fetchAddr, branchPred);
-        return 0;
+// replacement policies for choosing which line of a full set to evict
+enum tcReplPolicyType
+{
+    TC_REPL_RANDOM = 0, // seeded, per-instance pseudo random
+    TC_REPL_LRU = 1, // true LRU
+    TC_REPL_PLRU = 2, // tree pseudo LRU
+    TC_REPL_NRU = 3, // not recently used, one reference bit per line
+    TC_REPL_SRRIP = 4, // static re-reference interval prediction
+    TC_REPL_BRRIP = 5, // bimodal RRIP, mostly inserts at distant re-reference
+    TC_REPL_DRRIP = 6, // set dueling between SRRIP and BRRIP
+    TC_REPL_OPT = 7    // Belady's optimal, needs a pre-scanned tcNextUse
+};
+
+// names of the replacement policies, indexed by tcReplPolicyType
+static const char* const tcReplPolicyNames[] = {
+    "random", "lru", "plru", "nru", "srrip", "brrip", "drrip", "opt"
+};
+
+// returns the tcReplPolicyType called name, or -1
+inline int tcReplPolicyFromName(const char* name){
+    for(int i = 0; i < (int)(sizeof(tcReplPolicyNames) / sizeof(tcReplPolicyNames[0])); i++){
+        if(strcmp(name, tcReplPolicyNames[i]) == 0){
+            return i;
+        }
     }
+    return -1;
+}
 
-    void logHitStats(uint64_t fetchAddr, int branchPred, int i){
-        this->globalHitCount++;
+// mixes a 64-bit value into a well distributed 64-bit hash (splitmix64)
+inline uint64_t tcHash64(uint64_t x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// interface of a replacement policy. The cache tells the policy about
+// hits (touch), misses (miss) and fills (insert), and asks it for a victim
+// when a set has no invalid line left. Every policy keeps its metadata in
+// per-set arrays sized at construction.
+class tcReplPolicy
+{
+  public:
+    int numSets; // number of sets in the cache
+    int assoc; // associativity of the cache
+
+    // Constructor
+    tcReplPolicy(int numSets, int assoc) {
+        this->numSets = numSets;
+        this->assoc = assoc;
     }
 
-    void logMissStats(uint64_t fetchAddr, int branchPred){
-        this->globalMissCount++;
+    virtual ~tcReplPolicy() {}
+
+    // a lookup hit way in set
+    virtual void touch(int set, int way) = 0;
+
+    // a lookup missed in set
+    virtual void miss(int set) {}
+
+    // a new trace was written to way in set
+    virtual void insert(int set, int way) = 0;
+
+    // returns the way to evict from a set with every way valid
+    virtual int victim(int set) = 0;
+};
+
+// random replacement. Each set draws from its own counter-based stream
+// seeded per instance, so results are reproducible and do not depend on
+// anything else in the process calling rand().
+class tcReplRandom final : public tcReplPolicy
+{
+  public:
+    uint64_t  seed;
+    uint32_t* draws; // number of victims drawn so far in each set
+
+    // Constructor
+    tcReplRandom(int numSets, int assoc, uint64_t seed)
+        : tcReplPolicy(numSets, assoc) {
+        this->seed = tcHash64(seed);
+        this->draws = new uint32_t[numSets]();
     }
 
-    void buildTrace(uint64_t fetchAddr, int branchPred){
-        // if we are not currently building a trace, then this is the first
-        // instruction of the trace
-        if(this->buildingTrace == 0){
-            // set up trace
-            this->buildLine->tagAddr = fetchAddr; // save the PC
-            this->buildLine->branchFlags = branchPred;
-            this->buildLine->insnCount = 1;
-            this->buildLine->BBCount = 1;
-            // tell system we are now building a trace
-            this->buildingTrace = 1;
+    ~tcReplRandom() {
+        delete[] this->draws;
+    }
+
+    void touch(int set, int way) override {}
+    void insert(int set, int way) override {}
+
+    int victim(int set) override {
+        uint64_t r = tcHash64(this->seed ^ ((uint64_t)set << 32) ^
+                              this->draws[set]++);
+        return r % this->assoc;
+    }
+};
+
+// true LRU. Each line keeps its recency rank within the set, 0 being the
+// most recently used.
+class tcReplLRU final : public tcReplPolicy
+{
+  public:
+    uint16_t* rank; // rank[set*assoc + way]
+
+    // Constructor
+    tcReplLRU(int numSets, int assoc) : tcReplPolicy(numSets, assoc) {
+        assert(assoc <= 65536);
+        this->rank = new uint16_t[numSets*assoc];
+        for(int s = 0; s < numSets; s++){
+            for(int w = 0; w < assoc; w++){
+                this->rank[s*assoc + w] = w;
+            }
         }
-        // if we are currently building a trace, then we need to add this insn to the trace
-        else{
-            // increment the instruction count of the line
-            this->buildLine->insnCount++;
+    }
+
+    ~tcReplLRU() {
+        delete[] this->rank;
+    }
+
+    void touch(int set, int way) override {
+        uint16_t* r = this->rank + set*this->assoc;
+        uint16_t old = r[way];
+        for(int w = 0; w < this->assoc; w++){
+            r[w] += r[w] < old;
         }
+        r[way] = 0;
+    }
 
-        // check whether the trace has reached its max capacity
-        if(this->buildLine->insnCount >= this->maxNumInsns){
-            completeTrace();
+    void insert(int set, int way) override {
+        this->touch(set, way);
+    }
+
+    int victim(int set) override {
+        const uint16_t* r = this->rank + set*this->assoc;
+        for(int w = 0; w < this->assoc; w++){
+            if(r[w] == this->assoc - 1){
+                return w;
+            }
         }
+        return 0;
     }
+};
 
-    int searchTraceLine(uint64_t fetchAddr, int branchPred, int lineIndex){
-        // check for hit conditions
-        if((fetchAddr == this->line[lineIndex].tagAddr)&
-           (branchPred == this->line[lineIndex].branchFlags)&
-           (this->line[lineIndex].valid == 1)){
-               return 1; // line hit
-        }else{
-            return 0; // line miss
+// tree pseudo LRU. Each set keeps one bit per internal node of a binary
+// tree over its ways (heap order, root at node 1); a bit of 1 means the
+// pseudo LRU line is in the right subtree. Works for any associativity by
+// never walking into a subtree that holds no ways.
+class tcReplPLRU final : public tcReplPolicy
+{
+  public:
+    int       treeWays; // associativity rounded up to a power of two
+    int       words; // 64-bit words of tree bits per set
+    uint64_t* bits; // bits[set*words + node/64], bit node%64
+
+    // Constructor
+    tcReplPLRU(int numSets, int assoc) : tcReplPolicy(numSets, assoc) {
+        this->treeWays = 1;
+        while(this->treeWays < assoc){
+            this->treeWays *= 2;
         }
+        this->words = (this->treeWays + 63) / 64;
+        this->bits = new uint64_t[numSets*this->words]();
     }
 
-    int selectBuildLineIndex(int lowerSearchBound, int upperSearchBound){
-        // first, see if there are any lines which are invalid
-        for(int i = lowerSearchBound; i < upperSearchBound; i++){
-            if(this->line[i].valid == 0){ // found an invalid line
-                return i;
+    ~tcReplPLRU() {
+        delete[] this->bits;
+    }
+
+    void touch(int set, int way) override {
+        uint64_t* b = this->bits + set*this->words;
+        int node = 1;
+        int lo = 0;
+        int hi = this->treeWays;
+        // point every node on the path away from way
+        while(hi - lo > 1){
+            int mid = (lo + hi) / 2;
+            if(way < mid){
+                b[node / 64] |= 1ULL << (node % 64);
+                node = 2*node;
+                hi = mid;
+            }else{
+                b[node / 64] &= ~(1ULL << (node % 64));
+                node = 2*node + 1;
+                lo = mid;
             }
         }
-        // if there are no invalid cache lines, randomly pick a line to evict
-        return lowerSearchBound + (rand() % upperSearchBound);
     }
 
-    void completeTrace(){
-        // copy all buildLine values to the correct line in the tc
-        this->line[this->buildLineIndex].tagAddr = this->buildLine->tagAddr;
-        this->line[this->buildLineIndex].branchFlags = this->buildLine->branchFlags;
-        this->line[this->buildLineIndex].insnCount = this->buildLine->insnCount;
-        this->line[this->buildLineIndex].BBCount = this->buildLine->BBCount;
-        this->line[this->buildLineIndex].valid = 1;
+    void insert(int set, int way) override {
+        this->touch(set, way);
+    }
 
-        // clear out all buildLine values
-        this->buildLine->tagAddr = 9;
-        this->buildLine->branchFlags = 0;
-        this->buildLine->insnCount = 0;
-        this->buildLine->BBCount = 0;
+    int victim(int set) override {
+        const uint64_t* b = this->bits + set*this->words;
+        int node = 1;
+        int lo = 0;
+        int hi = this->treeWays;
+        while(hi - lo > 1){
+            int mid = (lo + hi) / 2;
+            int right = (b[node / 64] >> (node % 64)) & 1;
+            if(right && mid < this->assoc){
+                node = 2*node + 1;
+                lo = mid;
+            }else{
+                node = 2*node;
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+};
 
-        // no longer building a trace
-        this->buildingTrace = 0;
-        this->buildLineIndex = 0;
+// not recently used. One reference bit per line; the victim is the first
+// line whose bit is clear, and when every bit is set they are all cleared.
+class tcReplNRU final : public tcReplPolicy
+{
+  public:
+    int       words; // 64-bit words of reference bits per set
+    uint64_t* refBits; // refBits[set*words + way/64], bit way%64
+
+    // Constructor
+    tcReplNRU(int numSets, int assoc) : tcReplPolicy(numSets, assoc) {
+        this->words = (assoc + 63) / 64;
+        this->refBits = new uint64_t[numSets*this->words]();
     }
-    
-    void printCacheState(){
-     if(this->fetchInsnCount>=100000000){
-	printf("No. of instructions fetched:%d\n",this->fetchInsnCount);
-      	printf("******TRACE CACHE STATE******\n");
-    	printf("Current Miss Count: %d\n", this->globalMissCount);
-    	printf("Current Hit Count: %d\n\n", this->globalHitCount);
-//	this->MissRate = (this->globalMissCount/(this->globalMissCount+this->globalHitCount))*100;
-//	printf("Current Miss Rate: %f",MissRate);
+
+    ~tcReplNRU() {
+        delete[] this->refBits;
     }
+
+    void touch(int set, int way) override {
+        this->refBits[set*this->words + way / 64] |= 1ULL << (way % 64);
     }
-    
-    void printCacheParameters(){
-      if(this->fetchInsnCount>=100000000){
-      printf("******TRACE CACHE PARAMS******\n");
-      printf("Size: %d\n", this->size);
-      printf("Number of Sets: %d\n", this->numSets);
-      printf("Associativity: %d\n", this->assoc);
-      printf("Max # of Insns Per Line: %d\n", this->maxNumInsns);
+
+    void insert(int set, int way) override {
+        this->touch(set, way);
     }
+
+    int victim(int set) override {
+        uint64_t* r = this->refBits + set*this->words;
+        for(int w = 0; w < this->assoc; w += 64){
+            uint64_t clear = ~r[w / 64];
+            if(clear){
+                int way = w + __builtin_ctzll(clear);
+                if(way < this->assoc){
+                    return way;
+                }
+            }
+        }
+        for(int i = 0; i < this->words; i++){
+            r[i] = 0;
+        }
+        return 0;
     }
-    void testCache(){
-        printf("THIS IS FROM TRACE CACHE!!!\n");
+};
+
+// re-reference interval prediction with 2-bit RRPVs (SRRIP, BRRIP and
+// set-dueling DRRIP). Hits predict a near re-reference (0), the victim is
+// the first line predicted distant (3), aging the set until one is found.
+class tcReplRRIP final : public tcReplPolicy
+{
+  public:
+    static constexpr int maxRRPV = 3;
+    // BRRIP inserts at maxRRPV-1 once in this many fills
+    static constexpr int brripLongEvery = 32;
+    static constexpr int pselMax = 1023; // 10-bit policy selector
+    // one leader set of each kind in every leaderStride sets
+    static constexpr int leaderStride = 32;
+
+    int       mode; // TC_REPL_SRRIP, TC_REPL_BRRIP or TC_REPL_DRRIP
+    uint8_t*  rrpv; // rrpv[set*assoc + way]
+    uint32_t* fills; // fills per set, throttles BRRIP's long insertions
+    int       psel; // DRRIP: above the midpoint, followers use BRRIP
+
+    // Constructor
+    tcReplRRIP(int numSets, int assoc, int mode) : tcReplPolicy(numSets, assoc) {
+        this->mode = mode;
+        this->rrpv = new uint8_t[numSets*assoc];
+        for(int i = 0; i < numSets*assoc; i++){
+            this->rrpv[i] = maxRRPV;
+        }
+        this->fills = new uint32_t[numSets]();
+        this->psel = pselMax / 2;
+    }
+
+    ~tcReplRRIP() {
+        delete[] this->rrpv;
+        delete[] this->fills;
+    }
+
+    // which insertion policy a set uses
+    int setMode(int set){
+        if(this->mode != TC_REPL_DRRIP){
+            return this->mode;
+        }
+        if(set % leaderStride == 0){
+            return TC_REPL_SRRIP; // SRRIP leader
+        }
+        if(set % leaderStride == 1){
+            return TC_REPL_BRRIP; // BRRIP leader
+        }
+        return this->psel > pselMax / 2 ? TC_REPL_BRRIP : TC_REPL_SRRIP;
+    }
+
+    void touch(int set, int way) override {
+        this->rrpv[set*this->assoc + way] = 0;
+    }
+
+    void miss(int set) override {
+        // misses in a leader set vote against its policy
+        if(this->mode == TC_REPL_DRRIP){
+            if(set % leaderStride == 0 && this->psel < pselMax){
+                this->psel++;
+            }else if(set % leaderStride == 1 && this->psel > 0){
+                this->psel--;
+            }
+        }
+    }
+
+    void insert(int set, int way) override {
+        int insertRRPV = maxRRPV - 1;
+        if(this->setMode(set) == TC_REPL_BRRIP){
+            insertRRPV = this->fills[set] % brripLongEvery == 0 ? maxRRPV - 1 : maxRRPV;
+        }
+        this->fills[set]++;
+        this->rrpv[set*this->assoc + way] = insertRRPV;
+    }
+
+    int victim(int set) override {
+        uint8_t* r = this->rrpv + set*this->assoc;
+        while(1){
+            for(int w = 0; w < this->assoc; w++){
+                if(r[w] == maxRRPV){
+                    return w;
+                }
+            }
+            for(int w = 0; w < this->assoc; w++){
+                r[w]++;
+            }
+        }
+    }
+};
+
+// identifies a trace: its start address and the branch predictions along
+// its path
+class tcTraceKey
+{
+  public:
+    uint64_t tagAddr;
+    int      branchFlags;
+
+    tcTraceKey(uint64_t tagAddr, int branchFlags) {
+        this->tagAddr = tagAddr;
+        this->branchFlags = branchFlags;
     }
 
+    bool operator==(const tcTraceKey &other) const {
+        return this->tagAddr == other.tagAddr &&
+               this->branchFlags == other.branchFlags;
+    }
+
+    struct hash {
+        size_t operator()(const tcTraceKey &k) const {
+            return tcHash64(k.tagAddr ^ ((uint64_t)(uint32_t)k.branchFlags << 48));
+        }
+    };
 };
 
+// next-use oracle for Belady's optimal replacement. The lookups a cache
+// sees depend only on the fetch stream, so the stream can be scanned
+// ahead of time: feed every fetch to scan(), then call finish() to
+// annotate each lookup with the distance to the next lookup of the same
+// trace in one backward pass. Distances are kept as 32-bit values; a
+// trace that is never looked up again, or not for 2^32-1 lookups, is
+// marked never.
+class tcNextUse
+{
+  public:
+    static constexpr uint32_t never = 0xffffffffu;
+
+    traceBuilder builder; // must cut traces like the caches it serves
+    vector<tcTraceKey> keys; // lookups in order, freed by finish()
+    vector<uint32_t> nextUse; // nextUse[i] = lookups until key i recurs
+
+    // Constructor
+    tcNextUse(int numInsns, int numBBs) : builder(numInsns, numBBs) {}
+
+    // to be ran every instruction fetch of the pre-scan
+    void scan(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+    }
+
+    // OPT sees every lookup, so none is dropped
+    int dropsTrace(uint64_t fetchAddr, int branchPred){ return 0; }
+    void traceDropped(){}
+
+    void searchTraceCache(uint64_t fetchAddr, int branchFlags){
+        this->keys.push_back(tcTraceKey(fetchAddr, branchFlags));
+    }
+
+    void completeTrace(const tcLine &trace) {}
+
+    // returns 1 if the scanned lookups are the ones a cache cutting traces
+    // at numInsns instructions and numBBs basic blocks sees. The set index
+    // does not change where traces are cut, so any index function fits;
+    // only sampling drops lookups, and it is not allowed with OPT.
+    int matches(int numInsns, int numBBs) const {
+        return this->builder.maxNumInsns == numInsns &&
+               this->builder.maxNumBBs == numBBs;
+    }
+
+    // computes nextUse from the scanned lookups
+    void finish(){
+        uint64_t n = this->keys.size();
+        unordered_map<tcTraceKey, uint64_t, tcTraceKey::hash> lastSeen;
+        this->nextUse.assign(n, never);
+        for(uint64_t i = n; i-- > 0; ){
+            auto it = lastSeen.find(this->keys[i]);
+            if(it != lastSeen.end()){
+                uint64_t d = it->second - i;
+                this->nextUse[i] = d < never ? d : never;
+                it->second = i;
+            }else{
+                lastSeen.emplace(this->keys[i], i);
+            }
+        }
+        vector<tcTraceKey>().swap(this->keys);
+    }
+};
+
+// Belady's optimal replacement: evicts the line whose trace is looked up
+// again furthest in the future. Counts lookups to know where it is in the
+// scanned stream. Every miss still fills, so this bounds what any
+// replacement policy can reach on a cache that always fills.
+class tcReplOPT final : public tcReplPolicy
+{
+  public:
+    const tcNextUse* oracle;
+    uint64_t  lookupIndex; // index of the next lookup in the scanned stream
+    uint64_t  missNextUse; // next use of the trace that last missed
+    uint64_t* lineNextUse; // lineNextUse[set*assoc + way]
+
+    // Constructor
+    tcReplOPT(int numSets, int assoc, const tcNextUse* oracle)
+        : tcReplPolicy(numSets, assoc) {
+        assert(oracle != NULL);
+        this->oracle = oracle;
+        this->lookupIndex = 0;
+        this->missNextUse = UINT64_MAX;
+        this->lineNextUse = new uint64_t[numSets*assoc]();
+    }
+
+    ~tcReplOPT() {
+        delete[] this->lineNextUse;
+    }
+
+    // position of the next lookup of the trace being looked up now
+    uint64_t nextUseOfLookup(){
+        uint64_t i = this->lookupIndex++;
+        if(i >= this->oracle->nextUse.size() ||
+           this->oracle->nextUse[i] == tcNextUse::never){
+            return UINT64_MAX;
+        }
+        return i + this->oracle->nextUse[i];
+    }
+
+    void touch(int set, int way) override {
+        this->lineNextUse[set*this->assoc + way] = this->nextUseOfLookup();
+    }
+
+    void miss(int set) override {
+        this->missNextUse = this->nextUseOfLookup();
+    }
+
+    void insert(int set, int way) override {
+        this->lineNextUse[set*this->assoc + way] = this->missNextUse;
+    }
+
+    int victim(int set) override {
+        const uint64_t* n = this->lineNextUse + set*this->assoc;
+        int way = 0;
+        for(int w = 1; w < this->assoc; w++){
+            if(n[w] > n[way]){
+                way = w;
+            }
+        }
+        return way;
+    }
+};
+
+// builds the replacement policy selected by type
+inline tcReplPolicy* makeReplPolicy(int type, int numSets, int assoc, uint64_t seed,
+                                    const tcNextUse* oracle = NULL){
+    switch(type){
+      case TC_REPL_LRU:
+        return new tcReplLRU(numSets, assoc);
+      case TC_REPL_PLRU:
+        return new tcReplPLRU(numSets, assoc);
+      case TC_REPL_NRU:
+        return new tcReplNRU(numSets, assoc);
+      case TC_REPL_SRRIP:
+      case TC_REPL_BRRIP:
+      case TC_REPL_DRRIP:
+        return new tcReplRRIP(numSets, assoc, type);
+      case TC_REPL_OPT:
+        return new tcReplOPT(numSets, assoc, oracle);
+      default:
+        return new tcReplRandom(numSets, assoc, seed);
+    }
+}
+
+// construction options for a trace cache
+// set index functions. Modulo takes the low address bits, which puts
+// every trace starting at a hot branch target into one set whatever path
+// it follows. The others fold more of the trace key into the index.
+enum tcIndexFunc
+{
+    TC_INDEX_MODULO = 0, // low address bits
+    TC_INDEX_XOR = 1,    // all address bits XOR-folded down to the index
+    TC_INDEX_PATH = 2,   // XOR-fold of the address mixed with branchFlags
+    TC_INDEX_SKEW = 3    // a different hash of address and path per way
+};
+
+// XOR-folds x down to numBits bits
+inline uint64_t tcFoldBits(uint64_t x, int numBits){
+    if(numBits == 0){
+        return 0;
+    }
+    uint64_t mask = (1ULL << numBits) - 1;
+    uint64_t folded = 0;
+    while(x){
+        folded ^= x & mask;
+        x >>= numBits;
+    }
+    return folded;
+}
+
+// returns the set a trace maps to under indexFunc. The low indexShift
+// address bits are dropped first, so e.g. 4-byte aligned instructions do
+// not waste two index bits. way only matters for TC_INDEX_SKEW.
+inline int tcSetIndex(int indexFunc, uint64_t fetchAddr, int branchFlags,
+                      int numIndexBits, int indexShift, int way = 0){
+    uint64_t addr = fetchAddr >> indexShift;
+    uint64_t mask = (1ULL << numIndexBits) - 1;
+    switch(indexFunc){
+        case TC_INDEX_XOR:
+            return tcFoldBits(addr, numIndexBits);
+        case TC_INDEX_PATH:
+            return tcFoldBits(addr ^ tcHash64((uint32_t)branchFlags), numIndexBits);
+        case TC_INDEX_SKEW:
+            return tcHash64(addr ^ ((uint64_t)(uint32_t)branchFlags << 32) ^
+                            tcHash64(way)) & mask;
+        default:
+            return addr & mask;
+    }
+}
+
+class tcParams
+{
+  public:
+    int numSets; // number of sets in the cache
+    int assoc; // associativity of the cache
+    int maxNumInsns; // max number of insns in one cache line
+    int maxNumBBs; // max number of basic blocks in one cache line
+    int layout; // one of tcLayout
+    int replPolicy; // one of tcReplPolicyType
+    uint64_t seed; // seed for random replacement
+    const tcNextUse* oracle; // pre-scanned stream for TC_REPL_OPT
+    int partialMatch; // 1 = misses report the longest matching prefix,
+                      // needs an index function that ignores the path
+    int indexFunc; // one of tcIndexFunc
+    int indexShift; // low fetch address bits skipped by the index
+    int classifyMisses; // 1 = classify misses with shadow caches
+    int profileTraces; // > 0 = report this many hottest traces per event
+    int sampleSets; // > 1 = only model 1 in sampleSets sets
+    int sampleHashed; // 1 = pick the sampled sets by hash, else every
+                      // sampleSets-th set
+
+    // Constructor
+    tcParams(int numSets, int assoc, int numInsns, int numBBs) {
+        this->numSets = numSets;
+        this->assoc = assoc;
+        this->maxNumInsns = numInsns;
+        this->maxNumBBs = numBBs;
+        this->layout = TC_LAYOUT_AOS;
+        this->replPolicy = TC_REPL_RANDOM;
+        this->seed = 1;
+        this->oracle = NULL;
+        this->partialMatch = 0;
+        this->indexFunc = TC_INDEX_MODULO;
+        this->indexShift = 0;
+        this->classifyMisses = 0;
+        this->profileTraces = 0;
+        this->sampleSets = 0;
+        this->sampleHashed = 0;
+    }
+
+    // returns NULL if traceCache can model these options together,
+    // otherwise what is wrong with them
+    const char* check() const {
+        if(this->layout == TC_LAYOUT_PACKED){
+            // the line fields have to fit their packed widths
+            if(this->partialMatch){
+                return "the packed layout has no room for partial matching";
+            }
+            if(this->maxNumInsns > (int)tcPackedLine::insnMask){
+                return "the packed layout holds at most 1023 instructions per line";
+            }
+        }
+        // with skewed indexing the ways of a lookup sit in different sets,
+        // so only random replacement still makes sense
+        if(this->indexFunc == TC_INDEX_SKEW && this->replPolicy != TC_REPL_RANDOM){
+            return "skewed indexing only supports random replacement";
+        }
+        if(this->replPolicy == TC_REPL_OPT){
+            if(this->oracle == NULL){
+                return "OPT replacement needs a pre-scanned tcNextUse";
+            }
+            // otherwise OPT would steer by another lookup stream
+            if(!this->oracle->matches(this->maxNumInsns, this->maxNumBBs)){
+                return "the OPT oracle was scanned with other trace limits";
+            }
+        }
+        if(this->partialMatch){
+            // branchMask only covers the first 64 instructions of a line
+            if(this->maxNumInsns > 64){
+                return "partial matching supports at most 64 instructions per line";
+            }
+            // only the lookup's own set is searched for a prefix, and when
+            // the path picks the set, traces sharing just a prefix of it
+            // sit in other sets
+            if(this->indexFunc == TC_INDEX_PATH || this->indexFunc == TC_INDEX_SKEW){
+                return "partial matching needs an index function that ignores the path";
+            }
+        }
+        if(this->sampleSets > 1){
+            // every way of a skewed lookup is in a different set
+            if(this->indexFunc == TC_INDEX_SKEW){
+                return "set sampling does not support skewed indexing";
+            }
+            // dropped lookups never reach the policy, and OPT's clock has
+            // to count every lookup of the pre-scanned stream
+            if(this->replPolicy == TC_REPL_OPT){
+                return "set sampling does not support OPT replacement";
+            }
+        }
+        return NULL;
+    }
+};
+
+// reports a configuration the models cannot run and exits. Unlike an
+// assert this also stops NDEBUG builds, such as gem5's fast and opt ones.
+inline void tcFatal(const char* what){
+    fprintf(stderr, "traceCache: %s\n", what);
+    exit(1);
+}
+
+// tcMatchWays returns a bitmask with bit j set when tags[j] == fetchAddr
+// and flags[j] == branchPred. n must be a multiple of 8 and at most 64.
+// On x86 there is an AVX2, an SSE4.1 and a scalar version. A build that
+// already targets AVX2 (-mavx2 or -march=native) calls the AVX2 one
+// directly; otherwise, as in gem5's baseline x86-64 build, the best one
+// the host supports is picked once at run time.
+
+inline uint64_t tcMatchWaysScalar(const uint64_t* tags, const int* flags, int n,
+                                  uint64_t fetchAddr, int branchPred){
+    uint64_t match = 0;
+    for(int j = 0; j < n; j++){
+        match |= (uint64_t)((tags[j] == fetchAddr) &
+                            (flags[j] == branchPred)) << j;
+    }
+    return match;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline uint64_t tcMatchWaysAVX2(const uint64_t* tags, const int* flags, int n,
+                                uint64_t fetchAddr, int branchPred){
+    uint64_t match = 0;
+    __m256i tagKey = _mm256_set1_epi64x((long long)fetchAddr);
+    __m256i flagKey = _mm256_set1_epi32(branchPred);
+    for(int j = 0; j < n; j += 8){
+        __m256i t0 = _mm256_loadu_si256((const __m256i*)(tags + j));
+        __m256i t1 = _mm256_loadu_si256((const __m256i*)(tags + j + 4));
+        __m256i f = _mm256_loadu_si256((const __m256i*)(flags + j));
+        uint64_t tagBits =
+            (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+                _mm256_cmpeq_epi64(t0, tagKey))) |
+            ((uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+                _mm256_cmpeq_epi64(t1, tagKey))) << 4);
+        uint64_t flagBits = (uint64_t)_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(f, flagKey)));
+        match |= (tagBits & flagBits) << j;
+    }
+    return match;
+}
+
+__attribute__((target("sse4.1")))
+inline uint64_t tcMatchWaysSSE41(const uint64_t* tags, const int* flags, int n,
+                                 uint64_t fetchAddr, int branchPred){
+    uint64_t match = 0;
+    __m128i tagKey = _mm_set1_epi64x((long long)fetchAddr);
+    __m128i flagKey = _mm_set1_epi32(branchPred);
+    for(int j = 0; j < n; j += 4){
+        __m128i t0 = _mm_loadu_si128((const __m128i*)(tags + j));
+        __m128i t1 = _mm_loadu_si128((const __m128i*)(tags + j + 2));
+        __m128i f = _mm_loadu_si128((const __m128i*)(flags + j));
+        uint64_t tagBits =
+            (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(
+                _mm_cmpeq_epi64(t0, tagKey))) |
+            ((uint64_t)_mm_movemask_pd(_mm_castsi128_pd(
+                _mm_cmpeq_epi64(t1, tagKey))) << 2);
+        uint64_t flagBits = (uint64_t)_mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpeq_epi32(f, flagKey)));
+        match |= (tagBits & flagBits) << j;
+    }
+    return match;
+}
+
+typedef uint64_t (*tcMatchWaysFn)(const uint64_t*, const int*, int, uint64_t, int);
+
+// the best version the host supports
+inline tcMatchWaysFn tcPickMatchWays(){
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return tcMatchWaysAVX2;
+    }
+    if(__builtin_cpu_supports("sse4.1")){
+        return tcMatchWaysSSE41;
+    }
+    return tcMatchWaysScalar;
+}
+#endif
+
+inline uint64_t tcMatchWays(const uint64_t* tags, const int* flags, int n,
+                            uint64_t fetchAddr, int branchPred){
+#if defined(__AVX2__)
+    return tcMatchWaysAVX2(tags, flags, n, fetchAddr, branchPred);
+#elif defined(__x86_64__) || defined(__i386__)
+    static const tcMatchWaysFn matchWays = tcPickMatchWays();
+    return matchWays(tags, flags, n, fetchAddr, branchPred);
+#else
+    return tcMatchWaysScalar(tags, flags, n, fetchAddr, branchPred);
+#endif
+}
+
+// counters for one set of a trace cache, kept together so a lookup only
+// touches one host cache line of them
+class tcSetCounters
+{
+  public:
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fills;
+    uint64_t evictions; // fills that replaced a valid line
+};
+
+// number of log2 buckets in the tcDetailedStats lifetime histograms
+static constexpr int tcLog2Buckets = 33;
+
+// returns the log2 bucket of x: 0 for 0, else 1 + floor(log2(x)), capped
+inline int tcLog2Bucket(uint64_t x){
+    int b = x ? 64 - __builtin_clzll(x) : 0;
+    return b < tcLog2Buckets ? b : tcLog2Buckets - 1;
+}
+
+// detailed statistics of one trace cache: per-set hit/miss/fill/eviction
+// counts, trace length histograms at fill and at hit, instructions
+// delivered by partial hits, how long lines live and how often they hit
+// while resident, and how full the tag array is. Time is counted in
+// lookups of this cache. The owner reports every event; the counters are
+// flat arrays indexed by set, line and length. Only built into the
+// caches with TC_DETAILED_STATS defined.
+class tcDetailedStats
+{
+  public:
+    int numSets;
+    int assoc;
+    int maxNumInsns;
+
+    vector<tcSetCounters> setStore; // empty in a view
+    vector<uint64_t> lineFillTimeStore;
+    vector<uint32_t> lineHitsStore;
+    tcSetCounters* sets; // sets[set]
+    vector<uint64_t> fillLength; // fillLength[insnCount], traces written
+    vector<uint64_t> hitLength; // hitLength[insnCount], traces that hit
+    vector<uint64_t> partialLength; // partialLength[insns], partial hits
+    uint64_t* lineFillTime; // lineFillTime[line], lookup of its fill
+    uint32_t* lineHits; // lineHits[line], hits since its fill
+    uint64_t lifetime[tcLog2Buckets]; // lookups from fill to eviction
+    uint64_t residentHits[tcLog2Buckets]; // hits of a line before eviction
+
+    uint64_t lookups; // lookups so far, the clock of the lifetimes
+    uint64_t validLines; // lines currently valid
+    uint64_t firstFillTimes; // sum of the lookup each valid line was first filled at
+
+    // Constructor
+    tcDetailedStats(int numSets, int assoc, int maxNumInsns)
+        : setStore(numSets), lineFillTimeStore(numSets*assoc),
+          lineHitsStore(numSets*assoc), fillLength(maxNumInsns + 1),
+          hitLength(maxNumInsns + 1), partialLength(maxNumInsns + 1) {
+        this->numSets = numSets;
+        this->assoc = assoc;
+        this->maxNumInsns = maxNumInsns;
+        memset(this->setStore.data(), 0, numSets*sizeof(tcSetCounters));
+        this->sets = this->setStore.data();
+        this->lineFillTime = this->lineFillTimeStore.data();
+        this->lineHits = this->lineHitsStore.data();
+        this->clearTotals();
+    }
+
+    // a view for one partition of owner's sets. The per-set and per-line
+    // counters are the owner's, since partitions touch disjoint slices;
+    // the histograms and totals are the view's own until merged.
+    explicit tcDetailedStats(tcDetailedStats* owner)
+        : fillLength(owner->maxNumInsns + 1), hitLength(owner->maxNumInsns + 1),
+          partialLength(owner->maxNumInsns + 1) {
+        this->numSets = owner->numSets;
+        this->assoc = owner->assoc;
+        this->maxNumInsns = owner->maxNumInsns;
+        this->sets = owner->sets;
+        this->lineFillTime = owner->lineFillTime;
+        this->lineHits = owner->lineHits;
+        this->clearTotals();
+    }
+
+    void clearTotals(){
+        std::fill(this->fillLength.begin(), this->fillLength.end(), 0);
+        std::fill(this->hitLength.begin(), this->hitLength.end(), 0);
+        std::fill(this->partialLength.begin(), this->partialLength.end(), 0);
+        for(int b = 0; b < tcLog2Buckets; b++){
+            this->lifetime[b] = 0;
+            this->residentHits[b] = 0;
+        }
+        this->lookups = 0;
+        this->validLines = 0;
+        this->firstFillTimes = 0;
+    }
+
+    // adds a view's histograms and totals, then clears them. The view's
+    // clock ran on the shared lookup numbering, so the later one wins.
+    void merge(tcDetailedStats &view){
+        for(int i = 0; i <= this->maxNumInsns; i++){
+            this->fillLength[i] += view.fillLength[i];
+            this->hitLength[i] += view.hitLength[i];
+            this->partialLength[i] += view.partialLength[i];
+        }
+        for(int b = 0; b < tcLog2Buckets; b++){
+            this->lifetime[b] += view.lifetime[b];
+            this->residentHits[b] += view.residentHits[b];
+        }
+        this->lookups = std::max(this->lookups, view.lookups);
+        this->validLines += view.validLines;
+        this->firstFillTimes += view.firstFillTimes;
+        view.clearTotals();
+    }
+
+    // lengths past maxNumInsns land in the last bucket
+    int lengthBucket(int insnCount){
+        return insnCount < this->maxNumInsns ? insnCount : this->maxNumInsns;
+    }
+
+    void hit(int set, int lineIndex, int insnCount){
+        this->lookups++;
+        this->sets[set].hits++;
+        this->hitLength[this->lengthBucket(insnCount)]++;
+        this->lineHits[lineIndex]++;
+    }
+
+    void miss(int set){
+        this->lookups++;
+        this->sets[set].misses++;
+    }
+
+    void partialHit(int insns){
+        this->partialLength[this->lengthBucket(insns)]++;
+    }
+
+    // a trace of insnCount instructions was written to lineIndex, which
+    // held a valid line before if wasValid
+    void fill(int set, int lineIndex, int insnCount, int wasValid){
+        this->sets[set].fills++;
+        this->fillLength[this->lengthBucket(insnCount)]++;
+        if(wasValid){
+            this->sets[set].evictions++;
+            this->lifetime[tcLog2Bucket(this->lookups - this->lineFillTime[lineIndex])]++;
+            this->residentHits[tcLog2Bucket(this->lineHits[lineIndex])]++;
+        }else{
+            this->validLines++;
+            this->firstFillTimes += this->lookups;
+        }
+        this->lineFillTime[lineIndex] = this->lookups;
+        this->lineHits[lineIndex] = 0;
+    }
+
+    // prints one histogram, skipping empty buckets
+    static void printHistogram(FILE* out, const char* name, const uint64_t* h,
+                               int n, int log2){
+        fprintf(out, "%s:", name);
+        for(int b = 0; b < n; b++){
+            if(h[b] == 0){
+                continue;
+            }
+            if(log2 && b > 1){
+                fprintf(out, " [%lu,%lu):%lu", 1UL << (b - 1), 1UL << b,
+                        (unsigned long)h[b]);
+            }else{
+                fprintf(out, " %d:%lu", b, (unsigned long)h[b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+
+    // prints the histograms and a summary of the per-set counters
+    void print(FILE* out){
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t maxMisses = 0;
+        int hotSet = 0;
+        int unusedSets = 0;
+        for(int s = 0; s < this->numSets; s++){
+            const tcSetCounters &c = this->sets[s];
+            hits += c.hits;
+            misses += c.misses;
+            evictions += c.evictions;
+            if(c.misses > maxMisses){
+                maxMisses = c.misses;
+                hotSet = s;
+            }
+            if(c.hits + c.misses == 0){
+                unusedSets++;
+            }
+        }
+        double meanMisses = (double)misses / this->numSets;
+        int size = this->numSets*this->assoc;
+        // a line first filled after lookup t was valid for the lookups after it
+        uint64_t validLineLookups = this->validLines*this->lookups - this->firstFillTimes;
+
+        fprintf(out, "******TRACE CACHE DETAILED STATS******\n");
+        fprintf(out, "Lookups: %lu, Evictions: %lu\n",
+                (unsigned long)this->lookups, (unsigned long)evictions);
+        fprintf(out, "Sets never looked up: %d of %d\n", unusedSets, this->numSets);
+        fprintf(out, "Misses per set: mean %.2f, max %lu (set %d)\n",
+                meanMisses, (unsigned long)maxMisses, hotSet);
+        fprintf(out, "Valid lines: %lu of %d now, %.2f%% on average\n",
+                (unsigned long)this->validLines, size,
+                this->lookups ? 100.0 * validLineLookups /
+                                ((double)this->lookups * size) : 0.0);
+        printHistogram(out, "Trace length at fill", this->fillLength.data(),
+                       this->maxNumInsns + 1, 0);
+        printHistogram(out, "Trace length at hit", this->hitLength.data(),
+                       this->maxNumInsns + 1, 0);
+        printHistogram(out, "Insns per partial hit", this->partialLength.data(),
+                       this->maxNumInsns + 1, 0);
+        printHistogram(out, "Line lifetime (lookups)", this->lifetime,
+                       tcLog2Buckets, 1);
+        printHistogram(out, "Hits per line lifetime", this->residentHits,
+                       tcLog2Buckets, 1);
+        fprintf(out, "\n");
+    }
+
+    // writes one CSV row per set
+    void printSets(FILE* out){
+        fprintf(out, "set,hits,misses,fills,evictions\n");
+        for(int s = 0; s < this->numSets; s++){
+            const tcSetCounters &c = this->sets[s];
+            fprintf(out, "%d,%lu,%lu,%lu,%lu\n", s, (unsigned long)c.hits,
+                    (unsigned long)c.misses, (unsigned long)c.fills,
+                    (unsigned long)c.evictions);
+        }
+    }
+};
+
+// common interface of every trace cache model: geometry, the global
+// hit/miss counters and the two events a model reacts to. Each model owns a
+// builder for standalone use through tcInsnFetch; a traceCacheBank instead
+// drives many models from one shared builder.
+class tcModel
+{
+  public:
+    // parameters
+    int numSets; // number of sets in the cache
+    int assoc; // associativity of the cache
+
+    // fields describing the trace cache
+    int    size; // size of the cache in terms of lines
+    int    maxNumInsns; // max number of insns in one cache line
+    uint64_t fetchInsnCount; // counter to count all the fetched instructions
+    int    maxNumBBs = 1; // max number of basic blocks in one cache line
+//    float MissRate;
+
+    // cuts this model's own fetch stream into traces
+    traceBuilder builder;
+
+    // Stats tracking
+    uint64_t globalHitCount;
+    uint64_t globalMissCount;
+    uint64_t globalHitInsnCount; // instructions delivered by trace hits
+    uint64_t globalPartialHitCount; // misses that still matched a prefix
+    uint64_t globalPartialInsnCount; // instructions delivered by those prefixes
+
+    // Constructor
+    tcModel(int numSets, int assoc, int numInsns, int numBBs)
+        : builder(numInsns, numBBs) {
+        // set tc parameter
+        this->numSets = numSets;
+        this->assoc = assoc;
+        // set tc fields for describing trace cache
+        this->size = assoc*numSets;
+        this->maxNumInsns = numInsns;
+        this->maxNumBBs = numBBs;
+        // set tc fields for stats tracking
+        this->globalHitCount = 0;
+        this->globalMissCount = 0;
+        this->globalHitInsnCount = 0;
+        this->globalPartialHitCount = 0;
+        this->globalPartialInsnCount = 0;
+        this->fetchInsnCount = 0;
+//        this->MissRate = 0;
+    }
+
+    virtual ~tcModel() {}
+
+    // to be ran every instruction fetch
+    virtual void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        this->fetchInsnCount++;
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+    }
+
+    // same as calling tcInsnFetch on each of the n records in order
+    virtual void tcInsnFetchBatch(const tcFetchRecord* records, int n){
+        this->builder.stepRecords(records, n, *this);
+        this->fetchInsnCount += n;
+    }
+
+    // same as fetching every instruction of the n block records
+    virtual void tcBlockFetchBatch(const tcBlockRecord* blocks, int n){
+        this->fetchInsnCount += this->builder.stepBlocks(blocks, n, *this);
+    }
+
+    // a trace starts at fetchAddr with branchFlags; returns 1 if hit, 0 if
+    // miss. On a miss the model decides where the trace will go.
+    virtual int searchTraceCache(uint64_t fetchAddr, int branchFlags) = 0;
+
+    // returns 1 if the trace whose first branch is at fetchAddr, predicted
+    // branchPred, is dropped whatever path it takes. The builder then only
+    // cuts it, and calls traceDropped where it would have looked it up.
+    virtual int dropsTrace(uint64_t fetchAddr, int branchPred){ return 0; }
+    virtual void traceDropped(){}
+
+    // the trace that was last looked up is complete
+    virtual void completeTrace(const tcLine &trace) = 0;
+
+    // the hit rate of the lookups so far in *rate, and the half width of
+    // its 95% confidence interval in *error. Models that see every lookup
+    // know it exactly.
+    virtual void hitRateEstimate(double* rate, double* error){
+        uint64_t lookups = this->globalHitCount + this->globalMissCount;
+        *rate = lookups ? (double)this->globalHitCount / lookups : 0.0;
+        *error = 0;
+    }
+
+    // prints the counters; meant for the end of a run or on demand, use
+    // tcStatsDumper for periodic output
+    void printCacheState(){
+        double rate, error;
+        this->hitRateEstimate(&rate, &error);
+	printf("No. of instructions fetched:%lu\n", (unsigned long)this->fetchInsnCount);
+      	printf("******TRACE CACHE STATE******\n");
+    	printf("Current Miss Count: %lu\n", (unsigned long)this->globalMissCount);
+    	printf("Current Hit Count: %lu\n", (unsigned long)this->globalHitCount);
+    	printf("Current Insns Delivered by Hits: %lu\n", (unsigned long)this->globalHitInsnCount);
+    	printf("Current Partial Hit Count: %lu\n", (unsigned long)this->globalPartialHitCount);
+    	printf("Current Insns Delivered by Partial Hits: %lu\n", (unsigned long)this->globalPartialInsnCount);
+    	printf("Current Hit Rate: %.4f +/- %.4f\n\n", rate, error);
+//	this->MissRate = (this->globalMissCount/(this->globalMissCount+this->globalHitCount))*100;
+//	printf("Current Miss Rate: %f",MissRate);
+    }
+    
+    void printCacheParameters(){
+      printf("******TRACE CACHE PARAMS******\n");
+      printf("Size: %d\n", this->size);
+      printf("Number of Sets: %d\n", this->numSets);
+      printf("Associativity: %d\n", this->assoc);
+      printf("Max # of Insns Per Line: %d\n", this->maxNumInsns);
+      printf("Max # of BBs Per Line: %d\n", this->maxNumBBs);
+    }
+    // prints the detailed statistics of models that keep them
+    virtual void printDetailedStats(FILE* out){}
+
+    void testCache(){
+        printf("THIS IS FROM TRACE CACHE!!!\n");
+    }
+};
+
+// fully associative LRU trace cache with constant-time lookup and
+// eviction. Lines live in a preallocated pool; an open-addressing hash
+// table (linear probing) maps (tagAddr, branchFlags) to a pool index, and
+// the pool is threaded into a doubly linked recency list. Hit and miss
+// counts match traceCache(1, assoc) with TC_REPL_LRU.
+class faTraceCache final : public tcModel
+{
+  public:
+    tcLine* line; // line pool
+    int*    prev; // towards the most recently used line, -1 at the head
+    int*    next; // towards the least recently used line, -1 at the tail
+    int     head; // most recently used line
+    int     tail; // least recently used line
+    int     numUsed; // lines filled so far; the pool fills in order
+
+    int*     table; // pool index per slot, -1 = empty
+    uint64_t tableMask; // table size - 1, the size is a power of two
+
+    // fields for building a trace in the trace cache
+    int buildingTrace; // 1 = the trace being built goes into this cache
+    int buildLineIndex; // line the trace is being built for
+
+    // Constructor
+    faTraceCache(int numLines, int numInsns, int numBBs)
+        : tcModel(1, numLines, numInsns, numBBs) {
+        this->line = new tcLine[numLines];
+        this->prev = new int[numLines];
+        this->next = new int[numLines];
+        this->head = -1;
+        this->tail = -1;
+        this->numUsed = 0;
+        // keep the table at most half full
+        uint64_t tableSize = 1;
+        while(tableSize < 2*(uint64_t)numLines){
+            tableSize <<= 1;
+        }
+        this->table = new int[tableSize];
+        for(uint64_t i = 0; i < tableSize; i++){
+            this->table[i] = -1;
+        }
+        this->tableMask = tableSize - 1;
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+    ~faTraceCache() {
+        delete[] this->line;
+        delete[] this->prev;
+        delete[] this->next;
+        delete[] this->table;
+    }
+
+    // runs a batch of fetches. With one basic block per trace, every
+    // branch starts a trace that is looked up right away with its own
+    // address and prediction, so the hash table slot of the branch
+    // tcPrefetchDistance records ahead is prefetched. With more blocks the
+    // key is only known at the trace's last branch, so nothing is.
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n) override {
+        if(this->maxNumBBs != 1){
+            tcModel::tcInsnFetchBatch(records, n);
+            return;
+        }
+        for(int i = 0; i < n; i++){
+            int ahead = i + tcPrefetchDistance;
+            if(ahead < n && records[ahead].isCondBranch){
+                __builtin_prefetch(this->table +
+                    this->homeSlot(records[ahead].addr, records[ahead].branchPred & 1));
+            }
+            this->builder.step(records[i].addr, records[i].isCondBranch,
+                               records[i].branchPred, *this);
+        }
+        this->fetchInsnCount += n;
+    }
+
+    uint64_t homeSlot(uint64_t tagAddr, int branchFlags){
+        return tcTraceKey::hash()(tcTraceKey(tagAddr, branchFlags)) & this->tableMask;
+    }
+
+    // returns the table slot holding the trace, or the empty slot where it
+    // would go
+    uint64_t findSlot(uint64_t tagAddr, int branchFlags){
+        uint64_t slot = this->homeSlot(tagAddr, branchFlags);
+        while(this->table[slot] >= 0){
+            const tcLine &l = this->line[this->table[slot]];
+            if(l.tagAddr == tagAddr && l.branchFlags == branchFlags){
+                break;
+            }
+            slot = (slot + 1) & this->tableMask;
+        }
+        return slot;
+    }
+
+    // empties a table slot and shifts later entries of the probe run back,
+    // so lookups never need tombstones
+    void eraseSlot(uint64_t slot){
+        uint64_t hole = slot;
+        uint64_t i = slot;
+        while(true){
+            i = (i + 1) & this->tableMask;
+            if(this->table[i] < 0){
+                break;
+            }
+            const tcLine &l = this->line[this->table[i]];
+            uint64_t home = this->homeSlot(l.tagAddr, l.branchFlags);
+            // the entry can move into the hole if its home is not
+            // cyclically within (hole, i]
+            if(((i - home) & this->tableMask) >= ((i - hole) & this->tableMask)){
+                this->table[hole] = this->table[i];
+                hole = i;
+            }
+        }
+        this->table[hole] = -1;
+    }
+
+    void unlink(int i){
+        if(this->prev[i] >= 0){
+            this->next[this->prev[i]] = this->next[i];
+        }else{
+            this->head = this->next[i];
+        }
+        if(this->next[i] >= 0){
+            this->prev[this->next[i]] = this->prev[i];
+        }else{
+            this->tail = this->prev[i];
+        }
+    }
+
+    void pushFront(int i){
+        this->prev[i] = -1;
+        this->next[i] = this->head;
+        if(this->head >= 0){
+            this->prev[this->head] = i;
+        }else{
+            this->tail = i;
+        }
+        this->head = i;
+    }
+
+    int searchTraceCache(uint64_t fetchAddr, int branchPred) override {
+        int i = this->table[this->findSlot(fetchAddr, branchPred)];
+        if(i >= 0){
+            this->unlink(i);
+            this->pushFront(i);
+            this->globalHitCount++;
+            this->globalHitInsnCount += this->line[i].insnCount;
+            return 1;
+        }
+
+        this->globalMissCount++;
+        // fill unused lines first, then replace the least recently used
+        if(this->numUsed < this->assoc){
+            this->buildLineIndex = this->numUsed;
+        }else{
+            this->buildLineIndex = this->tail;
+        }
+        this->buildingTrace = 1;
+        return 0;
+    }
+
+    void completeTrace(const tcLine &trace) override {
+        // traces that hit are already in the cache
+        if(this->buildingTrace == 0){
+            return;
+        }
+        int i = this->buildLineIndex;
+        if(i == this->numUsed){
+            this->numUsed++;
+        }else{
+            this->eraseSlot(this->findSlot(this->line[i].tagAddr, this->line[i].branchFlags));
+            this->unlink(i);
+        }
+        this->line[i] = trace;
+        this->line[i].valid = 1;
+        this->table[this->findSlot(trace.tagAddr, trace.branchFlags)] = i;
+        this->pushFront(i);
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+};
+
+// open-addressing hash table (linear probing) from a trace key to a
+// 32-bit value. The table doubles once it is half full. No fetch address
+// is all ones, so that marks an empty slot.
+class tcShadowTable
+{
+  public:
+    static constexpr uint64_t emptyAddr = ~0ULL;
+
+    class slot
+    {
+      public:
+        uint64_t tagAddr;
+        int      branchFlags;
+        uint32_t value;
+    };
+
+    vector<slot> slots;
+    uint64_t mask; // slots.size() - 1, the size is a power of two
+    uint64_t numUsed;
+
+    // Constructor
+    tcShadowTable(uint64_t size = 1024) {
+        uint64_t n = 16;
+        while(n < size){
+            n <<= 1;
+        }
+        this->slots.resize(n);
+        for(uint64_t i = 0; i < n; i++){
+            this->slots[i].tagAddr = emptyAddr;
+        }
+        this->mask = n - 1;
+        this->numUsed = 0;
+    }
+
+    // returns the slot holding the key, or the empty slot where it would go
+    uint64_t findSlot(uint64_t tagAddr, int branchFlags) const {
+        uint64_t i = tcTraceKey::hash()(tcTraceKey(tagAddr, branchFlags)) & this->mask;
+        while(this->slots[i].tagAddr != emptyAddr &&
+              (this->slots[i].tagAddr != tagAddr ||
+               this->slots[i].branchFlags != branchFlags)){
+            i = (i + 1) & this->mask;
+        }
+        return i;
+    }
+
+    // returns the value of the key, or NULL if it was never added
+    const uint32_t* find(uint64_t tagAddr, int branchFlags) const {
+        const slot &s = this->slots[this->findSlot(tagAddr, branchFlags)];
+        return s.tagAddr == emptyAddr ? NULL : &s.value;
+    }
+
+    uint32_t* find(uint64_t tagAddr, int branchFlags){
+        slot &s = this->slots[this->findSlot(tagAddr, branchFlags)];
+        return s.tagAddr == emptyAddr ? NULL : &s.value;
+    }
+
+    // returns the slot of the key, adding it with value 0 if it is new.
+    // *added tells which. Slots only move when an add grows the table.
+    uint64_t getSlot(uint64_t tagAddr, int branchFlags, int* added){
+        uint64_t i = this->findSlot(tagAddr, branchFlags);
+        *added = this->slots[i].tagAddr == emptyAddr;
+        if(*added){
+            if(2*(this->numUsed + 1) > this->slots.size()){
+                this->grow();
+                i = this->findSlot(tagAddr, branchFlags);
+            }
+            this->slots[i].tagAddr = tagAddr;
+            this->slots[i].branchFlags = branchFlags;
+            this->slots[i].value = 0;
+            this->numUsed++;
+        }
+        return i;
+    }
+
+    // returns the value of the key, adding it with value 0 if it is new.
+    // *added tells which. The reference is valid until the next add.
+    uint32_t& get(uint64_t tagAddr, int branchFlags, int* added){
+        return this->slots[this->getSlot(tagAddr, branchFlags, added)].value;
+    }
+
+    // pulls the slot a probe for the key starts at towards the host cache
+    void prefetch(uint64_t tagAddr, int branchFlags) const {
+        __builtin_prefetch(&this->slots[tcTraceKey::hash()(
+            tcTraceKey(tagAddr, branchFlags)) & this->mask]);
+    }
+
+    // removes the key if present. Later entries of the probe run shift
+    // back into the hole, as in faTraceCache::eraseSlot.
+    void erase(uint64_t tagAddr, int branchFlags){
+        uint64_t hole = this->findSlot(tagAddr, branchFlags);
+        if(this->slots[hole].tagAddr == emptyAddr){
+            return;
+        }
+        uint64_t i = hole;
+        while(true){
+            i = (i + 1) & this->mask;
+            if(this->slots[i].tagAddr == emptyAddr){
+                break;
+            }
+            uint64_t home = tcTraceKey::hash()(tcTraceKey(this->slots[i].tagAddr,
+                                               this->slots[i].branchFlags)) & this->mask;
+            if(((i - home) & this->mask) >= ((i - hole) & this->mask)){
+                this->slots[hole] = this->slots[i];
+                hole = i;
+            }
+        }
+        this->slots[hole].tagAddr = emptyAddr;
+        this->numUsed--;
+    }
+
+    void grow(){
+        vector<slot> old;
+        old.swap(this->slots);
+        this->slots.resize(2*old.size());
+        for(size_t i = 0; i < this->slots.size(); i++){
+            this->slots[i].tagAddr = emptyAddr;
+        }
+        this->mask = this->slots.size() - 1;
+        for(size_t i = 0; i < old.size(); i++){
+            if(old[i].tagAddr != emptyAddr){
+                this->slots[this->findSlot(old[i].tagAddr, old[i].branchFlags)] = old[i];
+            }
+        }
+    }
+};
+
+// classes of trace cache misses
+enum tcMissClass
+{
+    TC_MISS_COMPULSORY = 0, // first lookup of the trace
+    TC_MISS_PATH = 1,       // the cache holds another path from the same start
+    TC_MISS_CAPACITY = 2,   // a fully associative LRU cache would miss too
+    TC_MISS_CONFLICT = 3,   // a fully associative LRU cache would have hit
+    TC_NUM_MISS_CLASSES = 4
+};
+
+// classifies the misses of one cache with two shadows fed the same
+// lookups: the set of every trace ever looked up (an infinite cache) and
+// a fully associative LRU cache with the same number of lines. The
+// classes are checked in tcMissClass order and the first that applies
+// wins.
+//
+// Both shadows live in one table keyed by trace that never shrinks: a
+// trace is in the infinite cache once it has a slot, and in the LRU
+// shadow while its slot holds a shadow line (plus one, 0 = not resident).
+// A lookup is one probe; the fill that follows reuses the lookup's slot,
+// and the evicted line finds its slot through lineSlot. Path misses need
+// to know whether the real cache holds another line starting at the same
+// address. When the set index ignores the path, every such line sits in
+// the set the lookup just searched, and the owner passes that in.
+// Otherwise the valid lines per start address are counted in a second
+// table, kept up to date through fill().
+class tcMissClassifier
+{
+  public:
+    tcShadowTable traces; // every trace looked up, to its shadow line + 1
+    int       numLines; // lines of the LRU shadow
+    int       numUsed; // shadow lines filled so far; they fill in order
+    uint64_t* lineSlot; // lineSlot[line], the slot in traces holding it
+    int*      prev; // towards the most recently used line, -1 at the head
+    int*      next; // towards the least recently used line, -1 at the tail
+    int       head; // most recently used line
+    int       tail; // least recently used line
+    uint64_t  lookupSlot; // slot of the trace looked up last
+    int       lookupMissed; // 1 = the shadow fills it once it is complete
+
+    int countsResident; // 1 = the path picks the set, count resident lines
+    tcShadowTable resident; // valid lines per start address, flags 0
+    uint64_t missCount[TC_NUM_MISS_CLASSES];
+
+    // Constructor. pathIndexed tells whether the owner's set index
+    // depends on the path.
+    tcMissClassifier(int numLines, int pathIndexed)
+        : traces(4*numLines), resident(pathIndexed ? 2*numLines : 16) {
+        this->numLines = numLines;
+        this->numUsed = 0;
+        this->lineSlot = new uint64_t[numLines];
+        this->prev = new int[numLines];
+        this->next = new int[numLines];
+        this->head = -1;
+        this->tail = -1;
+        this->lookupSlot = 0;
+        this->lookupMissed = 0;
+        this->countsResident = pathIndexed;
+        for(int c = 0; c < TC_NUM_MISS_CLASSES; c++){
+            this->missCount[c] = 0;
+        }
+    }
+
+    ~tcMissClassifier() {
+        delete[] this->lineSlot;
+        delete[] this->prev;
+        delete[] this->next;
+    }
+
+    void unlink(int i){
+        if(this->prev[i] >= 0){
+            this->next[this->prev[i]] = this->next[i];
+        }else{
+            this->head = this->next[i];
+        }
+        if(this->next[i] >= 0){
+            this->prev[this->next[i]] = this->prev[i];
+        }else{
+            this->tail = this->prev[i];
+        }
+    }
+
+    void pushFront(int i){
+        this->prev[i] = -1;
+        this->next[i] = this->head;
+        if(this->head >= 0){
+            this->prev[this->head] = i;
+        }else{
+            this->tail = i;
+        }
+        this->head = i;
+    }
+
+    // pulls the slot a lookup of the trace starts at towards the host cache
+    void prefetch(uint64_t fetchAddr, int branchFlags){
+        this->traces.prefetch(fetchAddr, branchFlags);
+    }
+
+    // runs a lookup through the shadows and returns 1 if the trace was
+    // new. *shadowHit tells whether the LRU shadow held it.
+    int lookup(uint64_t fetchAddr, int branchFlags, int* shadowHit){
+        uint64_t mask = this->traces.mask;
+        int isNew = 0;
+        this->lookupSlot = this->traces.getSlot(fetchAddr, branchFlags, &isNew);
+        if(this->traces.mask != mask){
+            // the table grew and moved every slot
+            for(uint64_t i = 0; i <= this->traces.mask; i++){
+                uint32_t v = this->traces.slots[i].value;
+                if(this->traces.slots[i].tagAddr != tcShadowTable::emptyAddr && v){
+                    this->lineSlot[v - 1] = i;
+                }
+            }
+        }
+        uint32_t line = this->traces.slots[this->lookupSlot].value;
+        *shadowHit = line != 0;
+        this->lookupMissed = line == 0;
+        if(line){
+            this->unlink(line - 1);
+            this->pushFront(line - 1);
+        }
+        return isNew;
+    }
+
+    // the real cache hit
+    void hit(uint64_t fetchAddr, int branchFlags){
+        int shadowHit = 0;
+        this->lookup(fetchAddr, branchFlags, &shadowHit);
+    }
+
+    // the real cache missed; otherPath tells whether it holds a line
+    // starting at fetchAddr, unless countsResident is set. Returns the
+    // class of the miss.
+    int miss(uint64_t fetchAddr, int branchFlags, int otherPath){
+        int shadowHit = 0;
+        int isNew = this->lookup(fetchAddr, branchFlags, &shadowHit);
+        if(this->countsResident){
+            const uint32_t* lines = this->resident.find(fetchAddr, 0);
+            otherPath = lines && *lines > 0;
+        }
+        int c = TC_MISS_CONFLICT;
+        if(isNew){
+            c = TC_MISS_COMPULSORY;
+        }else if(otherPath){
+            c = TC_MISS_PATH;
+        }else if(!shadowHit){
+            c = TC_MISS_CAPACITY;
+        }
+        this->missCount[c]++;
+        return c;
+    }
+
+    // the trace that was last looked up is complete; the LRU shadow takes
+    // it if it missed there
+    void completeTrace(const tcLine &trace){
+        if(!this->lookupMissed){
+            return;
+        }
+        this->lookupMissed = 0;
+        // fill unused lines first, then replace the least recently used
+        int line = this->numUsed;
+        if(line < this->numLines){
+            this->numUsed++;
+        }else{
+            line = this->tail;
+            this->traces.slots[this->lineSlot[line]].value = 0;
+            this->unlink(line);
+        }
+        this->traces.slots[this->lookupSlot].value = line + 1;
+        this->lineSlot[line] = this->lookupSlot;
+        this->pushFront(line);
+    }
+
+    // the real cache wrote trace over old
+    void fill(const tcLine &old, const tcLine &trace){
+        if(!this->countsResident){
+            return;
+        }
+        int added = 0;
+        if(old.valid){
+            this->resident.get(old.tagAddr, 0, &added)--;
+        }
+        this->resident.get(trace.tagAddr, 0, &added)++;
+    }
+
+    void print(FILE* out){
+        fprintf(out, "******TRACE CACHE MISS CLASSES******\n");
+        fprintf(out, "Compulsory Misses: %lu\n", (unsigned long)this->missCount[TC_MISS_COMPULSORY]);
+        fprintf(out, "Path Misses: %lu\n", (unsigned long)this->missCount[TC_MISS_PATH]);
+        fprintf(out, "Capacity Misses: %lu\n", (unsigned long)this->missCount[TC_MISS_CAPACITY]);
+        fprintf(out, "Conflict Misses: %lu\n", (unsigned long)this->missCount[TC_MISS_CONFLICT]);
+        fprintf(out, "Distinct Traces: %lu\n\n", (unsigned long)this->traces.numUsed);
+    }
+};
+
+// Space-Saving heavy hitter sketch over trace keys. Keeps a fixed number
+// of counters; a key without one takes over the smallest, inheriting its
+// count as the error bound. Any key counted more than total/capacity
+// times is guaranteed to hold a counter. The counters form a min-heap
+// through heap[]/heapPos[] so the smallest is always at heap[0], and
+// table maps each tracked key to its counter.
+class tcSpaceSaving
+{
+  public:
+    class counter
+    {
+      public:
+        uint64_t tagAddr;
+        int      branchFlags;
+        uint64_t count; // may overcount by up to error
+        uint64_t error; // count of the key this counter took over from
+    };
+
+    int capacity;
+    int numUsed;
+    uint64_t total; // every key added
+    vector<counter> counters;
+    vector<int> heap; // counter indices, min-heap on count
+    vector<int> heapPos; // heapPos[counter] = position in heap
+    tcShadowTable table; // key -> counter index
+
+    // Constructor
+    tcSpaceSaving(int capacity)
+        : counters(capacity), heap(capacity), heapPos(capacity), table(2*capacity) {
+        this->capacity = capacity;
+        this->numUsed = 0;
+        this->total = 0;
+    }
+
+    // restores the heap below position i after its count grew
+    void siftDown(int i){
+        while(true){
+            int smallest = i;
+            int l = 2*i + 1;
+            int r = l + 1;
+            if(l < this->numUsed && this->countAt(l) < this->countAt(smallest)){
+                smallest = l;
+            }
+            if(r < this->numUsed && this->countAt(r) < this->countAt(smallest)){
+                smallest = r;
+            }
+            if(smallest == i){
+                return;
+            }
+            std::swap(this->heap[i], this->heap[smallest]);
+            this->heapPos[this->heap[i]] = i;
+            this->heapPos[this->heap[smallest]] = smallest;
+            i = smallest;
+        }
+    }
+
+    uint64_t countAt(int heapIndex){
+        return this->counters[this->heap[heapIndex]].count;
+    }
+
+    void add(uint64_t tagAddr, int branchFlags){
+        this->total++;
+        int added = 0;
+        uint32_t &c = this->table.get(tagAddr, branchFlags, &added);
+        if(!added){
+            this->counters[c].count++;
+            this->siftDown(this->heapPos[c]);
+            return;
+        }
+        if(this->numUsed < this->capacity){
+            // a free counter
+            int n = this->numUsed++;
+            c = n;
+            this->counters[n].tagAddr = tagAddr;
+            this->counters[n].branchFlags = branchFlags;
+            this->counters[n].count = 1;
+            this->counters[n].error = 0;
+            this->heap[n] = n;
+            this->heapPos[n] = n;
+            this->siftUp(n);
+            return;
+        }
+        // take over the smallest counter
+        int m = this->heap[0];
+        c = m;
+        counter &old = this->counters[m];
+        this->table.erase(old.tagAddr, old.branchFlags);
+        old.tagAddr = tagAddr;
+        old.branchFlags = branchFlags;
+        old.error = old.count;
+        old.count++;
+        this->siftDown(0);
+    }
+
+    void siftUp(int i){
+        while(i > 0){
+            int parent = (i - 1) / 2;
+            if(this->countAt(parent) <= this->countAt(i)){
+                return;
+            }
+            std::swap(this->heap[i], this->heap[parent]);
+            this->heapPos[this->heap[i]] = i;
+            this->heapPos[this->heap[parent]] = parent;
+            i = parent;
+        }
+    }
+
+    // returns the tracked counters, largest guaranteed count (count -
+    // error) first. On a stream without heavy hitters the counters keep
+    // changing hands, and ranking by count alone would put whichever key
+    // took one over last at the top.
+    vector<counter> ranked() const {
+        vector<counter> r(this->counters.begin(), this->counters.begin() + this->numUsed);
+        std::sort(r.begin(), r.end(), [](const counter &a, const counter &b){
+            if(a.count - a.error != b.count - b.error){
+                return a.count - a.error > b.count - b.error;
+            }
+            return a.count > b.count;
+        });
+        return r;
+    }
+};
+
+// HyperLogLog distinct counter over trace keys with 2^precision one-byte
+// registers; the standard error is about 1.04/sqrt(2^precision).
+class tcHyperLogLog
+{
+  public:
+    int precision;
+    vector<uint8_t> registers;
+
+    // Constructor
+    tcHyperLogLog(int precision = 14) : registers(1 << precision) {
+        this->precision = precision;
+    }
+
+    void add(uint64_t tagAddr, int branchFlags){
+        uint64_t h = tcTraceKey::hash()(tcTraceKey(tagAddr, branchFlags));
+        uint64_t reg = h >> (64 - this->precision);
+        // rank of the first set bit of the remaining bits, 1-based
+        uint64_t rest = h << this->precision;
+        uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - this->precision + 1;
+        if(rank > this->registers[reg]){
+            this->registers[reg] = rank;
+        }
+    }
+
+    double estimate() const {
+        double m = this->registers.size();
+        double sum = 0;
+        int zeros = 0;
+        for(size_t i = 0; i < this->registers.size(); i++){
+            sum += ldexp(1.0, -this->registers[i]);
+            zeros += this->registers[i] == 0;
+        }
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        // linear counting is more accurate while many registers are empty
+        if(e <= 2.5 * m && zeros){
+            e = m * log(m / zeros);
+        }
+        return e;
+    }
+};
+
+// profiles which traces a cache hits, misses and evicts most, in constant
+// memory: one Space-Saving sketch per event and a HyperLogLog of the
+// distinct traces looked up. Every trace is first looked up as a miss, so
+// only misses feed the HyperLogLog.
+class tcTraceProfiler
+{
+  public:
+    int topK; // traces reported per event
+    tcSpaceSaving hits;
+    tcSpaceSaving misses;
+    tcSpaceSaving evictions;
+    tcHyperLogLog distinct;
+
+    // Constructor. Each sketch keeps 8*topK counters so the reported top
+    // topK are accurate.
+    tcTraceProfiler(int topK)
+        : hits(8*topK), misses(8*topK), evictions(8*topK) {
+        this->topK = topK;
+    }
+
+    void hit(uint64_t fetchAddr, int branchFlags){
+        this->hits.add(fetchAddr, branchFlags);
+    }
+
+    void miss(uint64_t fetchAddr, int branchFlags){
+        this->misses.add(fetchAddr, branchFlags);
+        this->distinct.add(fetchAddr, branchFlags);
+    }
+
+    void evict(const tcLine &old){
+        this->evictions.add(old.tagAddr, old.branchFlags);
+    }
+
+    void printRanking(FILE* out, const char* name, const tcSpaceSaving &s){
+        vector<tcSpaceSaving::counter> r = s.ranked();
+        int n = (int)r.size() < this->topK ? (int)r.size() : this->topK;
+        fprintf(out, "Top %d traces by %s (of %lu):\n", n, name, (unsigned long)s.total);
+        for(int i = 0; i < n; i++){
+            fprintf(out, "  %2d  pc 0x%lx flags 0x%x  %lu (at least %lu)  %.2f%%\n", i + 1,
+                    (unsigned long)r[i].tagAddr, (unsigned)r[i].branchFlags,
+                    (unsigned long)r[i].count, (unsigned long)(r[i].count - r[i].error),
+                    s.total ? 100.0 * r[i].count / s.total : 0.0);
+        }
+    }
+
+    void print(FILE* out){
+        fprintf(out, "******TRACE CACHE HOT TRACES******\n");
+        fprintf(out, "Distinct Traces (estimate): %.0f\n", this->distinct.estimate());
+        this->printRanking(out, "misses", this->misses);
+        this->printRanking(out, "hits", this->hits);
+        this->printRanking(out, "evictions", this->evictions);
+        fprintf(out, "\n");
+    }
+};
+
+// represents the trace cache as an array of tcLine objects
+// Each line holds one trace of up to maxNumBBs basic blocks, see
+// traceBuilder for how traces are cut.
+class traceCache final : public tcModel
+{
+  public:
+    // fields describing the trace cache
+    tcLine* line; // NULL with TC_LAYOUT_PACKED
+    tcPackedLine* packedLine; // only allocated for TC_LAYOUT_PACKED
+    int    numIndexBits; // number of fetch address bits used as set index
+    int    indexFunc; // one of tcIndexFunc
+    int    indexShift; // low fetch address bits skipped by the index
+    vector<int> skewLines; // lines probed by the current skewed lookup
+
+    // fields for building a trace in the trace cache
+    int buildingTrace; // 1 = the trace being built goes into this cache
+    int buildLineIndex; // hold line # is trace cache that trace
+                        // is being built for
+
+    // partial matching: on a miss, find the line with the same start
+    // address whose branch flags match the longest prefix of the lookup
+    int partialMatch;
+    int lastMatchBBs; // basic blocks the last lookup could use
+    int lastMatchInsns; // instructions the last lookup could use
+
+    // structure-of-arrays tag store, only allocated for TC_LAYOUT_SOA.
+    // Every set is padded to setStride ways so the probe never needs a
+    // scalar tail; padding ways are never marked valid.
+    int       layout;
+    int       setStride; // ways per set in the tag store, multiple of 8
+    int       validWords; // 64-bit valid words per set
+    uint64_t* tagStore; // tagStore[set*setStride + way]
+    int*      flagStore; // flagStore[set*setStride + way]
+    uint64_t* validStore; // validStore[set*validWords + way/64], bit way%64
+
+    // picks victims once a set is full
+    tcReplPolicy* repl;
+    int replPolicy; // one of tcReplPolicyType
+
+    // NULL, or the cache whose lines, tag store and replacement state this
+    // view shares; see the view constructor
+    traceCache* owner;
+
+    // set sampling: traces that map to unsampled sets are dropped, and the
+    // builder skips over them from their first branch when the set is
+    // known there (path indexing with several blocks per trace only knows
+    // it at the lookup, which drops them instead). The hit rate is estimated
+    // from the sampled sets, each one a cluster of lookups. The counters
+    // are only allocated when sampling, and only sampled entries are
+    // ever written. Every sampleSets-th set picks up any stride in the set
+    // indices (e.g. aligned fetch addresses with indexShift 0); hashed
+    // selection does not. The interval assumes no handful of sets carries
+    // most of the hits, and is too narrow when one does.
+    int       sampleSets; // 0 = every set is modelled
+    int       numSampledSets;
+    uint64_t* sampleMask; // bit set%64 of word set/64 is set if sampled
+    uint64_t* sampleHits; // hits per set
+    uint64_t* sampleLookups; // lookups per set
+    uint64_t  sampleSkipCount; // lookups dropped
+
+    // sorts misses into tcMissClass, NULL unless classifyMisses is set
+    tcMissClassifier* classifier;
+    // finds the hottest traces, NULL unless profileTraces is set
+    tcTraceProfiler* profiler;
+
+#ifdef TC_DETAILED_STATS
+    tcDetailedStats detail;
+#endif
+
+    // Constructor
+    traceCache(int numSets, int assoc, int numInsns, int numBBs)
+        : traceCache(tcParams(numSets, assoc, numInsns, numBBs)) {}
+
+    traceCache(const tcParams &p)
+        : tcModel(p.numSets, p.assoc, p.maxNumInsns, p.maxNumBBs)
+#ifdef TC_DETAILED_STATS
+        , detail(p.numSets, p.assoc, p.maxNumInsns)
+#endif
+    {
+        if(const char* why = p.check()){
+            tcFatal(why);
+        }
+        // create an array of lines
+        this->line = NULL;
+        this->packedLine = NULL;
+        if(p.layout == TC_LAYOUT_PACKED){
+            this->packedLine = new tcPackedLine[p.assoc*p.numSets];
+        }else{
+            this->line = new tcLine[p.assoc*p.numSets];
+        }
+        // the set index width does not change, so work it out once
+        this->numIndexBits = log2(this->numSets);
+        this->indexFunc = p.indexFunc;
+        this->indexShift = p.indexShift;
+        this->skewLines.resize(p.assoc);
+        // set up the tag store
+        this->layout = p.layout;
+        this->setStride = (p.assoc + 7) & ~7;
+        this->validWords = (this->setStride + 63) / 64;
+        this->tagStore = NULL;
+        this->flagStore = NULL;
+        this->validStore = NULL;
+        if(this->layout == TC_LAYOUT_SOA){
+            this->tagStore = new uint64_t[this->numSets*this->setStride]();
+            this->flagStore = new int[this->numSets*this->setStride]();
+            this->validStore = new uint64_t[this->numSets*this->validWords]();
+        }
+        this->repl = makeReplPolicy(p.replPolicy, p.numSets, p.assoc, p.seed, p.oracle);
+        this->replPolicy = p.replPolicy;
+        this->owner = NULL;
+        // pick the sampled sets
+        this->sampleSets = p.sampleSets > 1 ? p.sampleSets : 0;
+        this->numSampledSets = this->numSets;
+        this->sampleMask = NULL;
+        this->sampleHits = NULL;
+        this->sampleLookups = NULL;
+        this->sampleSkipCount = 0;
+        if(this->sampleSets){
+            this->sampleMask = new uint64_t[(this->numSets + 63) / 64]();
+            this->sampleHits = new uint64_t[this->numSets]();
+            this->sampleLookups = new uint64_t[this->numSets]();
+            this->numSampledSets = 0;
+            int minSet = 0;
+            uint64_t minPick = ~0ULL;
+            for(int set = 0; set < this->numSets; set++){
+                uint64_t pick = p.sampleHashed ? tcHash64(p.seed ^ set) : set;
+                if(pick % this->sampleSets == 0){
+                    this->sampleMask[set / 64] |= 1ULL << (set % 64);
+                    this->numSampledSets++;
+                }
+                if(pick < minPick){
+                    minPick = pick;
+                    minSet = set;
+                }
+            }
+            // hashing can miss every set of a small cache; keep the lowest
+            if(this->numSampledSets == 0){
+                this->sampleMask[minSet / 64] |= 1ULL << (minSet % 64);
+                this->numSampledSets = 1;
+            }
+        }
+        this->partialMatch = p.partialMatch;
+        this->lastMatchBBs = 0;
+        this->lastMatchInsns = 0;
+        this->classifier = NULL;
+        if(p.classifyMisses){
+            // the shadows only see the sampled sets' lookups, so they get
+            // the capacity of those sets
+            this->classifier = new tcMissClassifier(this->numSampledSets*this->assoc,
+                p.indexFunc == TC_INDEX_PATH || p.indexFunc == TC_INDEX_SKEW);
+        }
+        this->profiler = NULL;
+        if(p.profileTraces > 0){
+            this->profiler = new tcTraceProfiler(p.profileTraces);
+        }
+        // set tc fields for building a trace
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+    // a view of owner: it works on the owner's lines, tag store and
+    // replacement state, but keeps its own counters and build state; its
+    // detailed stats share the owner's per-set and per-line arrays. Views
+    // that only look up traces of disjoint sets can run on different
+    // threads, as long as nothing couples the sets: no skewed index, no
+    // DRRIP set dueling, no OPT lookup clock, no shadows or profiler.
+    explicit traceCache(traceCache* owner)
+        : tcModel(owner->numSets, owner->assoc, owner->maxNumInsns, owner->maxNumBBs)
+#ifdef TC_DETAILED_STATS
+        , detail(&owner->detail)
+#endif
+    {
+        assert(owner->owner == NULL);
+        assert(owner->indexFunc != TC_INDEX_SKEW);
+        assert(owner->replPolicy != TC_REPL_DRRIP && owner->replPolicy != TC_REPL_OPT);
+        assert(owner->classifier == NULL && owner->profiler == NULL);
+        this->line = owner->line;
+        this->packedLine = owner->packedLine;
+        this->numIndexBits = owner->numIndexBits;
+        this->indexFunc = owner->indexFunc;
+        this->indexShift = owner->indexShift;
+        this->layout = owner->layout;
+        this->setStride = owner->setStride;
+        this->validWords = owner->validWords;
+        this->tagStore = owner->tagStore;
+        this->flagStore = owner->flagStore;
+        this->validStore = owner->validStore;
+        this->repl = owner->repl;
+        this->replPolicy = owner->replPolicy;
+        this->owner = owner;
+        this->sampleSets = owner->sampleSets;
+        this->numSampledSets = owner->numSampledSets;
+        this->sampleMask = owner->sampleMask;
+        this->sampleHits = owner->sampleHits;
+        this->sampleLookups = owner->sampleLookups;
+        this->sampleSkipCount = 0;
+        this->partialMatch = owner->partialMatch;
+        this->lastMatchBBs = 0;
+        this->lastMatchInsns = 0;
+        this->classifier = NULL;
+        this->profiler = NULL;
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+    ~traceCache() {
+        if(this->owner){
+            return; // the storage belongs to the owner
+        }
+        delete[] this->line;
+        delete[] this->packedLine;
+        delete[] this->tagStore;
+        delete[] this->flagStore;
+        delete[] this->validStore;
+        delete this->repl;
+        delete this->classifier;
+        delete this->profiler;
+        delete[] this->sampleMask;
+        delete[] this->sampleHits;
+        delete[] this->sampleLookups;
+    }
+
+    // to be ran every instruction fetch
+    void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred) override {
+        this->fetchInsnCount++;
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+    }
+
+    // runs a batch of fetches. With one basic block per trace, every
+    // branch starts a trace that is looked up right away with its own
+    // address and prediction, so the set of the branch tcPrefetchDistance
+    // records ahead is known and prefetched while the current record is
+    // handled. With more blocks the key is only known at the trace's last
+    // branch, and skewed lookups touch a different set per way, so those
+    // batches run without prefetching. So do sampled ones, which skip the
+    // records of dropped traces and keep the few sampled sets close anyway.
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n) override {
+        if(this->maxNumBBs != 1 || this->indexFunc == TC_INDEX_SKEW || this->sampleSets){
+            tcModel::tcInsnFetchBatch(records, n);
+            return;
+        }
+        for(int i = 0; i < n; i++){
+            int ahead = i + tcPrefetchDistance;
+            if(ahead < n && records[ahead].isCondBranch){
+                int set = tcSetIndex(this->indexFunc, records[ahead].addr,
+                                     records[ahead].branchPred & 1,
+                                     this->numIndexBits, this->indexShift);
+                this->prefetchSet(set);
+                if(this->classifier){
+                    this->classifier->prefetch(records[ahead].addr,
+                                               records[ahead].branchPred & 1);
+                }
+            }
+            this->builder.step(records[i].addr, records[i].isCondBranch,
+                               records[i].branchPred, *this);
+        }
+        this->fetchInsnCount += n;
+    }
+
+    void tcBlockFetchBatch(const tcBlockRecord* blocks, int n) override {
+        this->fetchInsnCount += this->builder.stepBlocks(blocks, n, *this);
+    }
+
+    // pulls the lines (or tag store rows) of a set towards the host cache
+    void prefetchSet(int set){
+        if(this->layout == TC_LAYOUT_SOA){
+            __builtin_prefetch(this->tagStore + set*this->setStride);
+            __builtin_prefetch(this->flagStore + set*this->setStride);
+        }else if(this->packedLine){
+            __builtin_prefetch(this->packedLine + set*this->assoc);
+        }else{
+            __builtin_prefetch(this->line + set*this->assoc);
+        }
+    }
+
+    // returns 1 if hit, 0 if miss
+    int searchTraceCache(uint64_t fetchAddr, int branchPred) override {
+        // get the index bits from the fetch address
+        int index = 0;
+        int lowerSearchBound = 0;
+        int upperSearchBound = 0;
+        int hit = 0;
+        if(this->indexFunc == TC_INDEX_SKEW){
+            return this->searchSkewed(fetchAddr, branchPred);
+        }
+        index = tcSetIndex(this->indexFunc, fetchAddr, branchPred,
+                           this->numIndexBits, this->indexShift);
+
+        // drop traces of unsampled sets the builder could not skip; they
+        // never fill either
+        if(!this->setSampled(index)){
+            this->sampleSkipCount++;
+            this->buildingTrace = 0;
+            return 0;
+        }
+
+        // find bounds of tc lines to access
+        lowerSearchBound = index * this->assoc;
+        upperSearchBound = lowerSearchBound + this->assoc;
+
+        // with a tag store, compare the whole set at once
+        if(this->layout == TC_LAYOUT_SOA){
+            int way = this->probeTagStore(index, fetchAddr, branchPred);
+            if(way >= 0){
+                this->repl->touch(index, way);
+                this->logHitStats(fetchAddr, branchPred, lowerSearchBound + way);
+                return 1;
+            }
+        }else{
+            // search all lines in appropriate set for hit
+            for(int i = lowerSearchBound; i < upperSearchBound; i++ ){
+                hit = searchTraceLine(fetchAddr, branchPred, i);
+                if(hit){ // if there is a hit, exit early
+                    this->repl->touch(index, i - lowerSearchBound);
+                    // log the hit statistics
+                    this->logHitStats(fetchAddr, branchPred, i);
+                    return 1;
+                }
+            }
+        }
+
+        // if there is no hit - we have a trace cache miss
+        this->repl->miss(index);
+        this->logMissStats(fetchAddr, branchPred, index);
+
+        // a line starting at the same address may still deliver the blocks
+        // before the first branch that went the other way
+        if(this->partialMatch){
+            this->searchTracePrefix(fetchAddr, branchPred, lowerSearchBound, upperSearchBound);
+        }
+
+        // on a miss, the trace being built will be written to this cache.
+        // first, we figure out in which line the new trace should reside
+        this->buildLineIndex = this->selectBuildLineIndex(lowerSearchBound, upperSearchBound);
+        this->buildingTrace = 1;
+        return 0;
+    }
+
+    // returns the line way w of a skewed lookup maps to
+    int skewedLine(uint64_t fetchAddr, int branchPred, int w){
+        int set = tcSetIndex(TC_INDEX_SKEW, fetchAddr, branchPred,
+                             this->numIndexBits, this->indexShift, w);
+        return set*this->assoc + w;
+    }
+
+    // lookup with TC_INDEX_SKEW: each way is probed in its own set
+    int searchSkewed(uint64_t fetchAddr, int branchPred){
+        vector<int> &candidates = this->skewLines;
+        for(int w = 0; w < this->assoc; w++){
+            candidates[w] = this->skewedLine(fetchAddr, branchPred, w);
+            if(searchTraceLine(fetchAddr, branchPred, candidates[w])){
+                this->repl->touch(candidates[w] / this->assoc, w);
+                this->logHitStats(fetchAddr, branchPred, candidates[w]);
+                return 1;
+            }
+        }
+
+        this->repl->miss(candidates[0] / this->assoc);
+        this->logMissStats(fetchAddr, branchPred, candidates[0] / this->assoc);
+
+        // fill an invalid candidate first, else a random way
+        this->buildLineIndex = -1;
+        for(int w = 0; w < this->assoc && this->buildLineIndex < 0; w++){
+            if(this->lineValid(candidates[w]) == 0){
+                this->buildLineIndex = candidates[w];
+            }
+        }
+        if(this->buildLineIndex < 0){
+            this->buildLineIndex =
+                candidates[this->repl->victim(candidates[0] / this->assoc)];
+        }
+        this->buildingTrace = 1;
+        return 0;
+    }
+
+    // drops traces of unsampled sets, unless the path picks the set
+    int dropsTrace(uint64_t fetchAddr, int branchPred) override {
+        if(!this->sampleSets || (this->indexFunc == TC_INDEX_PATH && this->maxNumBBs > 1)){
+            return 0;
+        }
+        return !this->setSampled(tcSetIndex(this->indexFunc, fetchAddr, branchPred,
+                                            this->numIndexBits, this->indexShift));
+    }
+
+    void traceDropped() override {
+        this->sampleSkipCount++;
+    }
+
+    // returns 1 if set is modelled
+    int setSampled(int set){
+        return !this->sampleSets || ((this->sampleMask[set / 64] >> (set % 64)) & 1);
+    }
+
+    void logHitStats(uint64_t fetchAddr, int branchPred, int i){
+        this->globalHitCount++;
+        if(this->sampleSets){
+            this->sampleHits[i / this->assoc]++;
+            this->sampleLookups[i / this->assoc]++;
+        }
+        this->globalHitInsnCount += this->lineInsnCount(i);
+        if(this->classifier){
+            this->classifier->hit(fetchAddr, branchPred);
+        }
+        if(this->profiler){
+            this->profiler->hit(fetchAddr, branchPred);
+        }
+#ifdef TC_DETAILED_STATS
+        this->detail.hit(i / this->assoc, i, this->lineInsnCount(i));
+#endif
+    }
+
+    // set is the set the lookup went to (the first way's with skewing)
+    void logMissStats(uint64_t fetchAddr, int branchPred, int set){
+        this->globalMissCount++;
+        if(this->sampleSets){
+            this->sampleLookups[set]++;
+        }
+        if(this->classifier){
+            // unless the path picks the set, every line starting at
+            // fetchAddr is in this one
+            int otherPath = 0;
+            if(!this->classifier->countsResident){
+                otherPath = this->setHoldsStart(set, fetchAddr);
+            }
+            this->classifier->miss(fetchAddr, branchPred, otherPath);
+        }
+        if(this->profiler){
+            this->profiler->miss(fetchAddr, branchPred);
+        }
+#ifdef TC_DETAILED_STATS
+        this->detail.miss(set);
+#endif
+    }
+
+    // logs the trace written to buildLineIndex; call before the line changes
+    void logFillStats(const tcLine &trace){
+        if((this->classifier && this->classifier->countsResident) || this->profiler){
+            tcLine old = this->getLine(this->buildLineIndex);
+            if(this->classifier){
+                this->classifier->fill(old, trace);
+            }
+            if(this->profiler && old.valid){
+                this->profiler->evict(old);
+            }
+        }
+#ifdef TC_DETAILED_STATS
+        this->detail.fill(this->buildLineIndex / this->assoc, this->buildLineIndex,
+                          trace.insnCount, this->lineValid(this->buildLineIndex));
+#endif
+    }
+
+    // with sampling, the ratio of hits to lookups over the sampled sets.
+    // The sets are the sampling units, so the error comes from how much
+    // the sets' hit counts scatter around rate times their lookups.
+    void hitRateEstimate(double* rate, double* error) override {
+        tcModel::hitRateEstimate(rate, error);
+        if(!this->sampleSets){
+            return;
+        }
+        int m = this->numSampledSets;
+        uint64_t lookups = this->globalHitCount + this->globalMissCount;
+        if(m < 2 || lookups == 0){
+            *error = 1.0; // not enough to tell
+            return;
+        }
+        double sum = 0;
+        for(int set = 0; set < this->numSets; set++){
+            if(this->setSampled(set)){
+                double d = this->sampleHits[set] - *rate * this->sampleLookups[set];
+                sum += d * d;
+            }
+        }
+        double meanLookups = (double)lookups / m;
+        double fraction = (double)m / this->numSets;
+        double variance = (1 - fraction) * sum / (m - 1) / (m * meanLookups * meanLookups);
+        *error = 1.96 * sqrt(variance);
+    }
+
+    void printSampleStats(FILE* out){
+        double rate, error;
+        this->hitRateEstimate(&rate, &error);
+        uint64_t lookups = this->globalHitCount + this->globalMissCount;
+        uint64_t total = lookups + this->sampleSkipCount;
+        fprintf(out, "******TRACE CACHE SET SAMPLING******\n");
+        fprintf(out, "Sampled Sets: %d of %d\n", this->numSampledSets, this->numSets);
+        fprintf(out, "Sampled Lookups: %lu of %lu\n", (unsigned long)lookups,
+                (unsigned long)total);
+        fprintf(out, "Hit Rate: %.4f +/- %.4f (95%%)\n", rate, error);
+        fprintf(out, "Estimated Hits: %.0f, Estimated Misses: %.0f\n\n",
+                rate * total, (1 - rate) * total);
+    }
+
+    void printDetailedStats(FILE* out) override {
+        if(this->sampleSets){
+            this->printSampleStats(out);
+        }
+        if(this->classifier){
+            this->classifier->print(out);
+        }
+        if(this->profiler){
+            this->profiler->print(out);
+        }
+#ifdef TC_DETAILED_STATS
+        this->detail.print(out);
+#endif
+    }
+
+    // returns the number of leading basic blocks of a line that the branch
+    // predictions agree with, and the instructions up to and including the
+    // branch after them in matchInsns. Bit i of the XOR is the first
+    // disagreeing prediction, so the count is its trailing zeros.
+    int matchTracePrefix(int lineIndex, int branchPred, int* matchInsns){
+        const tcLine &l = this->line[lineIndex];
+        uint32_t diff = (uint32_t)(l.branchFlags ^ branchPred);
+        int bbs = diff ? __builtin_ctz(diff) : 32;
+        if(bbs >= l.BBCount){
+            // the whole line lies on the predicted path
+            *matchInsns = l.insnCount;
+            return l.BBCount;
+        }
+        // skip the first bbs branches; the next one ends the prefix
+        uint64_t mask = l.branchMask;
+        for(int b = 0; b < bbs; b++){
+            mask &= mask - 1;
+        }
+        *matchInsns = mask ? __builtin_ctzll(mask) + 1 : l.insnCount;
+        return bbs;
+    }
+
+    // looks for the longest usable prefix after a miss and logs it
+    void searchTracePrefix(uint64_t fetchAddr, int branchPred,
+                           int lowerSearchBound, int upperSearchBound){
+        this->lastMatchBBs = 0;
+        this->lastMatchInsns = 0;
+        for(int i = lowerSearchBound; i < upperSearchBound; i++){
+            this->matchPrefixLine(fetchAddr, branchPred, i);
+        }
+        this->logPartialStats();
+    }
+
+    // keeps line i as the best partial match if it beats the current one
+    void matchPrefixLine(uint64_t fetchAddr, int branchPred, int i){
+        if(this->line[i].valid == 1 && this->line[i].tagAddr == fetchAddr){
+            int insns = 0;
+            int bbs = this->matchTracePrefix(i, branchPred, &insns);
+            if(bbs > 0 && insns > this->lastMatchInsns){
+                this->lastMatchBBs = bbs;
+                this->lastMatchInsns = insns;
+            }
+        }
+    }
+
+    void logPartialStats(){
+        if(this->lastMatchBBs > 0){
+            this->globalPartialHitCount++;
+            this->globalPartialInsnCount += this->lastMatchInsns;
+#ifdef TC_DETAILED_STATS
+            this->detail.partialHit(this->lastMatchInsns);
+#endif
+        }
+    }
+
+    // returns 1 if a valid line of set starts at fetchAddr
+    int setHoldsStart(int set, uint64_t fetchAddr){
+        for(int i = set*this->assoc; i < (set + 1)*this->assoc; i++){
+            if(this->lineValid(i) && this->lineTagAddr(i) == fetchAddr){
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // line accessors that work for every layout
+    uint64_t lineTagAddr(int i){
+        if(this->packedLine){
+            return this->packedLine[i].tagAddr;
+        }
+        return this->line[i].tagAddr;
+    }
+
+    int lineValid(int i){
+        if(this->packedLine){
+            return this->packedLine[i].valid();
+        }
+        return this->line[i].valid;
+    }
+
+    int lineInsnCount(int i){
+        if(this->packedLine){
+            return this->packedLine[i].insnCount();
+        }
+        return this->line[i].insnCount;
+    }
+
+    // returns a copy of line i, unpacked if need be
+    tcLine getLine(int i){
+        if(this->packedLine){
+            return this->packedLine[i].unpack();
+        }
+        return this->line[i];
+    }
+
+    int searchTraceLine(uint64_t fetchAddr, int branchPred, int lineIndex){
+        if(this->packedLine){
+            return this->packedLine[lineIndex].matches(fetchAddr, branchPred);
+        }
+        // check for hit conditions
+        if((fetchAddr == this->line[lineIndex].tagAddr)&
+           (branchPred == this->line[lineIndex].branchFlags)&
+           (this->line[lineIndex].valid == 1)){
+               return 1; // line hit
+        }else{
+            return 0; // line miss
+        }
+    }
+
+    // returns the way in set that holds (fetchAddr, branchPred), or -1.
+    // Builds a bitmask of matching ways for the whole set and picks the
+    // lowest valid one.
+    int probeTagStore(int set, uint64_t fetchAddr, int branchPred){
+        const uint64_t* tags = this->tagStore + set*this->setStride;
+        const int* flags = this->flagStore + set*this->setStride;
+        const uint64_t* valid = this->validStore + set*this->validWords;
+
+        for(int w = 0; w < this->setStride; w += 64){
+            int chunkEnd = w + 64 < this->setStride ? w + 64 : this->setStride;
+            uint64_t match = tcMatchWays(tags + w, flags + w, chunkEnd - w,
+                                         fetchAddr, branchPred);
+            match &= valid[w / 64];
+            if(match){
+                return w + __builtin_ctzll(match);
+            }
+        }
+        return -1;
+    }
+
+    int selectBuildLineIndex(int lowerSearchBound, int upperSearchBound){
+        // with a tag store, the valid bits tell us directly
+        if(this->layout == TC_LAYOUT_SOA){
+            int set = lowerSearchBound / this->assoc;
+            const uint64_t* valid = this->validStore + set*this->validWords;
+            for(int w = 0; w < this->assoc; w += 64){
+                uint64_t invalid = ~valid[w / 64];
+                if(invalid){
+                    int way = w + __builtin_ctzll(invalid);
+                    if(way < this->assoc){
+                        return lowerSearchBound + way;
+                    }
+                }
+            }
+        }else{
+            // first, see if there are any lines which are invalid
+            for(int i = lowerSearchBound; i < upperSearchBound; i++){
+                if(this->lineValid(i) == 0){ // found an invalid line
+                    return i;
+                }
+            }
+        }
+        // if there are no invalid cache lines, let the policy pick a line
+        return lowerSearchBound + this->repl->victim(lowerSearchBound / this->assoc);
+    }
+
+    void completeTrace(const tcLine &trace) override {
+        // the shadows fill on their own misses, which may differ from ours
+        if(this->classifier){
+            this->classifier->completeTrace(trace);
+        }
+
+        // traces that hit are already in the cache
+        if(this->buildingTrace == 0){
+            return;
+        }
+
+        this->logFillStats(trace);
+
+        // copy all trace values to the correct line in the tc
+        if(this->packedLine){
+            this->packedLine[this->buildLineIndex].pack(trace);
+            this->packedLine[this->buildLineIndex].info |= 1;
+        }else{
+            this->line[this->buildLineIndex].tagAddr = trace.tagAddr;
+            this->line[this->buildLineIndex].branchFlags = trace.branchFlags;
+            this->line[this->buildLineIndex].insnCount = trace.insnCount;
+            this->line[this->buildLineIndex].BBCount = trace.BBCount;
+            this->line[this->buildLineIndex].branchMask = trace.branchMask;
+            this->line[this->buildLineIndex].valid = 1;
+        }
+
+        int set = this->buildLineIndex / this->assoc;
+        int way = this->buildLineIndex % this->assoc;
+        this->repl->insert(set, way);
+
+        // keep the tag store in step with the lines
+        if(this->layout == TC_LAYOUT_SOA){
+            int slot = set*this->setStride + way;
+            this->tagStore[slot] = trace.tagAddr;
+            this->flagStore[slot] = trace.branchFlags;
+            this->validStore[set*this->validWords + way / 64] |= 1ULL << (way % 64);
+        }
+
+        // no longer building a trace
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+
+};
+
+
+
+// compile-time specialized trace cache for the fixed geometries we run
+// most. Same behaviour as traceCache with one basic block per line, but
+// the index mask, set bounds and way loops are all constants, and the tags
+// always live in a structure-of-arrays tag store.
+template <int Sets, int Assoc, int MaxInsns>
+class traceCacheT final : public tcModel
+{
+    static_assert(Sets > 0 && (Sets & (Sets - 1)) == 0,
+                  "number of sets must be a power of two");
+    static_assert(Assoc >= 1 && Assoc <= 64,
+                  "associativity must fit in one valid word");
+    static_assert(MaxInsns >= 1, "a line holds at least one instruction");
+
+  public:
+    static constexpr uint64_t indexMask = Sets - 1;
+    // ways per set in the tag store; wide sets are padded for tcMatchWays
+    static constexpr int setStride = Assoc < 8 ? Assoc : (Assoc + 7) & ~7;
+    static constexpr uint64_t wayMask =
+        Assoc == 64 ? ~0ULL : (1ULL << Assoc) - 1;
+
+    // fields describing the trace cache
+    tcLine   line[Sets*Assoc];
+    uint64_t tagStore[Sets*setStride];
+    int      flagStore[Sets*setStride];
+    uint64_t validStore[Sets];
+
+    // picks victims once a set is full
+    tcReplPolicy* repl;
+
+    // fields for building a trace in the trace cache
+    int buildingTrace; // 1 = the trace being built goes into this cache
+    int buildLineIndex; // hold line # is trace cache that trace
+                        // is being built for
+
+    // Constructor
+    traceCacheT(int replPolicy = TC_REPL_RANDOM, uint64_t seed = 1,
+                const tcNextUse* oracle = NULL)
+        : tcModel(Sets, Assoc, MaxInsns, 1) {
+        if(replPolicy == TC_REPL_OPT && (oracle == NULL || !oracle->matches(MaxInsns, 1))){
+            tcFatal("OPT replacement needs a tcNextUse scanned with the same trace limits");
+        }
+        this->repl = makeReplPolicy(replPolicy, Sets, Assoc, seed, oracle);
+        for(int i = 0; i < Sets*setStride; i++){
+            this->tagStore[i] = 0;
+            this->flagStore[i] = 0;
+        }
+        for(int i = 0; i < Sets; i++){
+            this->validStore[i] = 0;
+        }
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+    ~traceCacheT() {
+        delete this->repl;
+    }
+
+    // to be ran every instruction fetch
+    void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred) override {
+        this->fetchInsnCount++;
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+    }
+
+    // the sink type is final here, so the lookups inline into the loop
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n) override {
+        for(int i = 0; i < n; i++){
+            this->builder.step(records[i].addr, records[i].isCondBranch,
+                               records[i].branchPred, *this);
+        }
+        this->fetchInsnCount += n;
+    }
+
+    void tcBlockFetchBatch(const tcBlockRecord* blocks, int n) override {
+        this->fetchInsnCount += this->builder.stepBlocks(blocks, n, *this);
+    }
+
+    // returns 1 if hit, 0 if miss
+    int searchTraceCache(uint64_t fetchAddr, int branchPred) override {
+        int set = fetchAddr & indexMask;
+        const uint64_t* tags = this->tagStore + set*setStride;
+        const int* flags = this->flagStore + set*setStride;
+
+        uint64_t match = 0;
+        if(setStride % 8 == 0){
+            match = tcMatchWays(tags, flags, setStride, fetchAddr, branchPred);
+        }else{
+            for(int w = 0; w < Assoc; w++){
+                match |= (uint64_t)((tags[w] == fetchAddr) &
+                                    (flags[w] == branchPred)) << w;
+            }
+        }
+        match &= this->validStore[set];
+
+        if(match){
+            int way = __builtin_ctzll(match);
+            this->repl->touch(set, way);
+            this->globalHitCount++;
+            this->globalHitInsnCount += this->line[set*Assoc + way].insnCount;
+            return 1;
+        }
+
+        // on a miss, pick the line the trace being built will go to
+        this->repl->miss(set);
+        this->globalMissCount++;
+        uint64_t invalid = ~this->validStore[set] & wayMask;
+        if(invalid){
+            this->buildLineIndex = set*Assoc + __builtin_ctzll(invalid);
+        }else{
+            this->buildLineIndex = set*Assoc + this->repl->victim(set);
+        }
+        this->buildingTrace = 1;
+        return 0;
+    }
+
+    void completeTrace(const tcLine &trace) override {
+        // traces that hit are already in the cache
+        if(this->buildingTrace == 0){
+            return;
+        }
+
+        // copy the built trace to its line and to the tag store
+        int set = this->buildLineIndex / Assoc;
+        int way = this->buildLineIndex % Assoc;
+        this->line[this->buildLineIndex] = trace;
+        this->tagStore[set*setStride + way] = trace.tagAddr;
+        this->flagStore[set*setStride + way] = trace.branchFlags;
+        this->validStore[set] |= 1ULL << way;
+        this->repl->insert(set, way);
+
+        // no longer building a trace
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+};
+
+// builds a trace cache model for the given parameters. The geometries we
+// hardcode in BaseSimpleCPU map to a compile-time specialized
+// traceCacheT. Other fully associative LRU caches use faTraceCache;
+// anything else falls back to the general traceCache. Builds with
+// TC_DETAILED_STATS always use traceCache, the only model keeping them.
+inline tcModel* makeTraceCache(const tcParams &p){
+    if(const char* why = p.check()){
+        tcFatal(why);
+    }
+    if(p.classifyMisses || p.profileTraces || p.sampleSets > 1){
+        // only traceCache runs the shadows, the profiler and sampling
+        return new traceCache(p);
+    }
+#ifdef TC_DETAILED_STATS
+    // and only traceCache keeps detailed stats
+    return new traceCache(p);
+#endif
+    if(p.maxNumInsns == 16 && p.maxNumBBs == 1 &&
+       p.indexFunc == TC_INDEX_MODULO && p.indexShift == 0){
+        if(p.numSets == 64 && p.assoc == 1){
+            return new traceCacheT<64,1,16>(p.replPolicy, p.seed, p.oracle);
+        }
+        if(p.numSets == 32 && p.assoc == 2){
+            return new traceCacheT<32,2,16>(p.replPolicy, p.seed, p.oracle);
+        }
+        if(p.numSets == 16 && p.assoc == 4){
+            return new traceCacheT<16,4,16>(p.replPolicy, p.seed, p.oracle);
+        }
+        if(p.numSets == 1 && p.assoc == 64){
+            return new traceCacheT<1,64,16>(p.replPolicy, p.seed, p.oracle);
+        }
+    }
+    if(p.numSets == 1 && p.replPolicy == TC_REPL_LRU && !p.partialMatch){
+        return new faTraceCache(p.assoc, p.maxNumInsns, p.maxNumBBs);
+    }
+    return new traceCache(p);
+}
+
+inline tcModel* makeTraceCache(int numSets, int assoc, int numInsns, int numBBs){
+    return makeTraceCache(tcParams(numSets, assoc, numInsns, numBBs));
+}
+
+// skewed-associative trace cache. Every way indexes its numSets slots
+// with its own hash of the trace key (TC_INDEX_SKEW), so traces that
+// collide in one way usually do not collide in the others. Lines carry
+// a last-use timestamp and the oldest candidate is replaced. With
+// relocate set, a miss also looks one step further (ZCache style): a
+// candidate's line may move to its slot in another way, which widens
+// the choice of victim from assoc to assoc*assoc lines.
+class skewedTraceCache final : public tcModel
+{
+  public:
+    tcLine*   line; // line[slot*assoc + way]
+    uint64_t* lastUse; // timestamp of the last hit or fill of each line
+    uint64_t  now; // advances on every hit and fill
+    int       numIndexBits; // number of bits of each way's slot index
+    int       indexShift; // low fetch address bits skipped by the index
+    int       relocate; // 1 = move a line within its ways to make room
+    uint64_t  relocationCount; // lines moved to make room
+
+    // fields for building a trace in the trace cache
+    int buildingTrace; // 1 = the trace being built goes into this cache
+    int buildLineIndex; // line the trace is being built for
+
+    // Constructor
+    skewedTraceCache(int numSets, int assoc, int numInsns, int numBBs,
+                     int relocate = 1, int indexShift = 0)
+        : tcModel(numSets, assoc, numInsns, numBBs) {
+        this->line = new tcLine[numSets*assoc];
+        this->lastUse = new uint64_t[numSets*assoc]();
+        this->now = 0;
+        this->numIndexBits = log2(numSets);
+        this->indexShift = indexShift;
+        this->relocate = relocate;
+        this->relocationCount = 0;
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+
+    ~skewedTraceCache() {
+        delete[] this->line;
+        delete[] this->lastUse;
+    }
+
+    // returns the line a trace maps to in way w
+    int wayLine(uint64_t tagAddr, int branchFlags, int w){
+        int slot = tcSetIndex(TC_INDEX_SKEW, tagAddr, branchFlags,
+                              this->numIndexBits, this->indexShift, w);
+        return slot*this->assoc + w;
+    }
+
+    int searchTraceCache(uint64_t fetchAddr, int branchPred) override {
+        for(int w = 0; w < this->assoc; w++){
+            int i = this->wayLine(fetchAddr, branchPred, w);
+            if(this->line[i].valid == 1 && this->line[i].tagAddr == fetchAddr &&
+               this->line[i].branchFlags == branchPred){
+                this->lastUse[i] = ++this->now;
+                this->globalHitCount++;
+                this->globalHitInsnCount += this->line[i].insnCount;
+                return 1;
+            }
+        }
+
+        this->globalMissCount++;
+        this->buildLineIndex = this->selectBuildLineIndex(fetchAddr, branchPred);
+        this->buildingTrace = 1;
+        return 0;
+    }
+
+    // picks the line the missing trace goes to, relocating one line if
+    // that frees an older victim
+    int selectBuildLineIndex(uint64_t fetchAddr, int branchPred){
+        int best = -1; // line that gets evicted
+        int bestVia = -1; // first-level line that moves into best, or -1
+        for(int w = 0; w < this->assoc; w++){
+            int i = this->wayLine(fetchAddr, branchPred, w);
+            if(this->line[i].valid == 0){
+                return i;
+            }
+            if(best < 0 || this->lastUse[i] < this->lastUse[best]){
+                best = i;
+                bestVia = -1;
+            }
+            if(!this->relocate){
+                continue;
+            }
+            // the line in i could move to its slot in any other way
+            for(int v = 0; v < this->assoc; v++){
+                if(v == w){
+                    continue;
+                }
+                // invalid lines have lastUse 0, so they win outright
+                int j = this->wayLine(this->line[i].tagAddr, this->line[i].branchFlags, v);
+                if(this->lastUse[j] < this->lastUse[best]){
+                    best = j;
+                    bestVia = i;
+                }
+            }
+        }
+        if(bestVia < 0){
+            return best;
+        }
+        // move the first-level line over the victim and fill its old place
+        this->line[best] = this->line[bestVia];
+        this->lastUse[best] = this->lastUse[bestVia];
+        this->line[bestVia].valid = 0;
+        this->lastUse[bestVia] = 0;
+        this->relocationCount++;
+        return bestVia;
+    }
+
+    void completeTrace(const tcLine &trace) override {
+        // traces that hit are already in the cache
+        if(this->buildingTrace == 0){
+            return;
+        }
+        this->line[this->buildLineIndex] = trace;
+        this->line[this->buildLineIndex].valid = 1;
+        this->lastUse[this->buildLineIndex] = ++this->now;
+        this->buildingTrace = 0;
+        this->buildLineIndex = 0;
+    }
+};
+
+// evaluates every associativity from 1 to maxAssoc at a fixed number of
+// sets in one run (Mattson stack algorithm). Each set keeps its traces in
+// recency order; a lookup that finds its trace at depth d would hit in
+// every LRU cache with more than d ways. Traces deeper than maxAssoc are
+// dropped since they miss in every cache we report on.
+class tcStackDistance final : public tcModel
+{
+  public:
+    int numIndexBits; // number of fetch address bits used as set index
+    int indexFunc; // one of tcIndexFunc, skewed indexing has no sets
+    int indexShift; // low fetch address bits skipped by the index
+
+    // per-set recency stacks, most recently used first
+    uint64_t* stackTag; // stackTag[set*assoc + depth]
+    int*      stackFlags; // stackFlags[set*assoc + depth]
+    int*      stackDepth; // number of traces held in each set's stack
+
+    // distanceCount[d] = lookups that found their trace at depth d
+    uint64_t* distanceCount;
+    uint64_t  lookupCount;
+
+    // Constructor
+    tcStackDistance(int numSets, int maxAssoc, int numInsns, int numBBs,
+                    int indexFunc = TC_INDEX_MODULO, int indexShift = 0)
+        : tcModel(numSets, maxAssoc, numInsns, numBBs) {
+        assert(indexFunc != TC_INDEX_SKEW);
+        this->numIndexBits = log2(numSets);
+        this->indexFunc = indexFunc;
+        this->indexShift = indexShift;
+        this->stackTag = new uint64_t[numSets*maxAssoc]();
+        this->stackFlags = new int[numSets*maxAssoc]();
+        this->stackDepth = new int[numSets]();
+        this->distanceCount = new uint64_t[maxAssoc]();
+        this->lookupCount = 0;
+    }
+
+    ~tcStackDistance() {
+        delete[] this->stackTag;
+        delete[] this->stackFlags;
+        delete[] this->stackDepth;
+        delete[] this->distanceCount;
+    }
+
+    // to be ran every instruction fetch
+    void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred) override {
+        this->fetchInsnCount++;
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+    }
+
+    // the sink type is final here, so the lookups inline into the loop
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n) override {
+        for(int i = 0; i < n; i++){
+            this->builder.step(records[i].addr, records[i].isCondBranch,
+                               records[i].branchPred, *this);
+        }
+        this->fetchInsnCount += n;
+    }
+
+    void tcBlockFetchBatch(const tcBlockRecord* blocks, int n) override {
+        this->fetchInsnCount += this->builder.stepBlocks(blocks, n, *this);
+    }
+
+    // returns 1 if the trace hits at the largest associativity
+    int searchTraceCache(uint64_t fetchAddr, int branchPred) override {
+        int set = tcSetIndex(this->indexFunc, fetchAddr, branchPred,
+                             this->numIndexBits, this->indexShift);
+        uint64_t* tags = this->stackTag + set*this->assoc;
+        int* flags = this->stackFlags + set*this->assoc;
+        int depth = this->stackDepth[set];
+        this->lookupCount++;
+
+        // find the trace in the stack
+        int d = 0;
+        while(d < depth && (tags[d] != fetchAddr || flags[d] != branchPred)){
+            d++;
+        }
+
+        int hit = d < depth;
+        if(hit){
+            this->distanceCount[d]++;
+            this->globalHitCount++;
+        }else{
+            this->globalMissCount++;
+            // a missing trace is filled, pushing the deepest one out
+            if(depth < this->assoc){
+                this->stackDepth[set]++;
+            }else{
+                d = this->assoc - 1;
+            }
+        }
+
+        // move the trace to the top of the stack
+        for(int i = d; i > 0; i--){
+            tags[i] = tags[i - 1];
+            flags[i] = flags[i - 1];
+        }
+        tags[0] = fetchAddr;
+        flags[0] = branchPred;
+        return hit;
+    }
+
+    // traces are placed in the stacks when they are looked up
+    void completeTrace(const tcLine &trace) override {}
+
+    // hits of an LRU cache with the same number of sets and assoc ways
+    uint64_t hitCount(int assoc){
+        uint64_t hits = 0;
+        for(int d = 0; d < assoc && d < this->assoc; d++){
+            hits += this->distanceCount[d];
+        }
+        return hits;
+    }
+
+    uint64_t missCount(int assoc){
+        return this->lookupCount - this->hitCount(assoc);
+    }
+
+    void printStackDistance(){
+        printf("******TRACE CACHE STACK DISTANCE******\n");
+        printf("Number of Sets: %d\n", this->numSets);
+        printf("Max # of Insns Per Line: %d\n", this->maxNumInsns);
+        for(int a = 1; a <= this->assoc; a++){
+            printf("Associativity %d: Hit Count: %lu, Miss Count: %lu\n", a,
+                   (unsigned long)this->hitCount(a),
+                   (unsigned long)this->missCount(a));
+        }
+    }
+};
+
+// output formats of tcStatsDumper
+enum tcStatsFormat
+{
+    TC_STATS_CSV = 0, // one header line, then one line per cache per snapshot
+    TC_STATS_JSON = 1 // one array of objects, one per cache per snapshot
+};
+
+// the counters of one cache at one point of the fetch stream
+class tcStatsSnapshot
+{
+  public:
+    uint64_t fetchInsnCount;
+    int      cache; // index of the cache in the snapshot
+    int      numSets;
+    int      assoc;
+    uint64_t hitCount;
+    uint64_t missCount;
+    uint64_t hitInsnCount;
+    uint64_t partialHitCount;
+    uint64_t partialInsnCount;
+    double   hitRate; // estimated when the cache samples its sets
+    double   hitRateError; // half width of the 95% confidence interval
+};
+
+// writes interval snapshots of trace cache counters to a CSV or JSON file.
+// Taking a snapshot only copies counters and hands the rows to a
+// background thread, which formats and writes them, so the file is never
+// touched on the fetch path.
+class tcStatsDumper
+{
+  public:
+    FILE*    file;
+    int      format; // one of tcStatsFormat
+    uint64_t interval; // fetches between snapshots, 0 = only on demand
+    uint64_t nextDump; // fetch count of the next interval snapshot
+    uint64_t numRows; // rows written so far, only touched by the writer
+
+    // rows handed to the writer and not written yet, guarded by lock
+    vector<tcStatsSnapshot> pending;
+    int         stopping; // 1 = write what is pending and end, guarded by lock
+    std::mutex  lock;
+    std::condition_variable wake; // signals pending rows or stopping
+    std::thread thread;
+
+    // Constructor
+    tcStatsDumper() {
+        this->file = NULL;
+        this->format = TC_STATS_CSV;
+        this->interval = 0;
+        this->nextDump = UINT64_MAX;
+        this->numRows = 0;
+        this->stopping = 0;
+    }
+
+    ~tcStatsDumper() {
+        this->close();
+    }
+
+    // returns 0 on success, -1 if the file cannot be created
+    int open(const char* path, int format, uint64_t interval){
+        this->file = fopen(path, "w");
+        if(this->file == NULL){
+            fprintf(stderr, "tcStatsDumper: cannot create %s\n", path);
+            return -1;
+        }
+        this->format = format;
+        this->interval = interval;
+        this->nextDump = interval ? interval : UINT64_MAX;
+        this->numRows = 0;
+        if(format == TC_STATS_CSV){
+            fprintf(this->file, "fetches,cache,sets,assoc,hits,misses,hitInsns,"
+                                "partialHits,partialInsns,hitRate,hitRateError\n");
+        }else{
+            fprintf(this->file, "[");
+        }
+        this->stopping = 0;
+        this->thread = std::thread(&tcStatsDumper::writerLoop, this);
+        return 0;
+    }
+
+    // records the counters of every cache at fetchInsnCount fetches
+    void snapshot(const vector<tcModel*> &caches, uint64_t fetchInsnCount){
+        // the next interval snapshot is the first boundary past this one
+        while(this->nextDump <= fetchInsnCount){
+            this->nextDump += this->interval;
+        }
+        if(this->file == NULL){
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            for(size_t i = 0; i < caches.size(); i++){
+                tcStatsSnapshot row;
+                row.fetchInsnCount = fetchInsnCount;
+                row.cache = i;
+                row.numSets = caches[i]->numSets;
+                row.assoc = caches[i]->assoc;
+                row.hitCount = caches[i]->globalHitCount;
+                row.missCount = caches[i]->globalMissCount;
+                row.hitInsnCount = caches[i]->globalHitInsnCount;
+                row.partialHitCount = caches[i]->globalPartialHitCount;
+                row.partialInsnCount = caches[i]->globalPartialInsnCount;
+                caches[i]->hitRateEstimate(&row.hitRate, &row.hitRateError);
+                this->pending.push_back(row);
+            }
+        }
+        this->wake.notify_one();
+    }
+
+    // formats rows into the file; only the writer thread calls this
+    void write(const vector<tcStatsSnapshot> &rows){
+        for(size_t i = 0; i < rows.size(); i++){
+            const tcStatsSnapshot &r = rows[i];
+            if(this->format == TC_STATS_CSV){
+                fprintf(this->file, "%lu,%d,%d,%d,%lu,%lu,%lu,%lu,%lu,%.6f,%.6f\n",
+                        (unsigned long)r.fetchInsnCount, r.cache, r.numSets, r.assoc,
+                        (unsigned long)r.hitCount, (unsigned long)r.missCount,
+                        (unsigned long)r.hitInsnCount, (unsigned long)r.partialHitCount,
+                        (unsigned long)r.partialInsnCount, r.hitRate, r.hitRateError);
+            }else{
+                fprintf(this->file, "%s\n  {\"fetches\": %lu, \"cache\": %d, \"sets\": %d, "
+                        "\"assoc\": %d, \"hits\": %lu, \"misses\": %lu, \"hitInsns\": %lu, "
+                        "\"partialHits\": %lu, \"partialInsns\": %lu, \"hitRate\": %.6f, "
+                        "\"hitRateError\": %.6f}",
+                        this->numRows ? "," : "",
+                        (unsigned long)r.fetchInsnCount, r.cache, r.numSets, r.assoc,
+                        (unsigned long)r.hitCount, (unsigned long)r.missCount,
+                        (unsigned long)r.hitInsnCount, (unsigned long)r.partialHitCount,
+                        (unsigned long)r.partialInsnCount, r.hitRate, r.hitRateError);
+            }
+            this->numRows++;
+        }
+        fflush(this->file);
+    }
+
+    void writerLoop(){
+        vector<tcStatsSnapshot> rows;
+        std::unique_lock<std::mutex> guard(this->lock);
+        while(true){
+            this->wake.wait(guard, [this](){
+                return !this->pending.empty() || this->stopping;
+            });
+            if(this->pending.empty()){
+                break; // stopping, and everything is written
+            }
+            rows.swap(this->pending);
+            guard.unlock();
+            this->write(rows);
+            rows.clear();
+            guard.lock();
+        }
+    }
+
+    // writes out every snapshot taken so far and closes the file
+    void close(){
+        if(this->file == NULL){
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->stopping = 1;
+        }
+        this->wake.notify_one();
+        this->thread.join();
+        if(this->format == TC_STATS_JSON){
+            fprintf(this->file, "\n]\n");
+        }
+        fclose(this->file);
+        this->file = NULL;
+    }
+};
+
+// runs several trace cache geometries off one fetch stream. Every fetch is
+// classified once by the shared builder, and each member only sees the
+// trace lookups and completed traces, so its stats are the same as those
+// of a separate instance fed the same stream.
+class traceCacheBank
+{
+  public:
+    traceBuilder builder; // shared by all members
+    vector<tcModel*> caches; // members, owned by the bank
+    uint64_t fetchInsnCount; // counter to count all the fetched instructions
+    tcStatsDumper* stats; // takes interval snapshots if set, not owned
+    int classifyMisses; // 1 = caches added by geometry classify their misses
+    int profileTraces; // > 0 = caches added by geometry profile hot traces
+
+    // fetches queued by queueFetch that have not been run yet
+    static constexpr int tcBankBatchSize = 4096;
+    tcFetchRecord pending[tcBankBatchSize];
+    int numPending;
+
+    // Constructor
+    traceCacheBank(int numInsns, int numBBs) : builder(numInsns, numBBs) {
+        this->fetchInsnCount = 0;
+        this->numPending = 0;
+        this->stats = NULL;
+        this->classifyMisses = 0;
+        this->profileTraces = 0;
+    }
+
+    ~traceCacheBank() {
+        for(size_t i = 0; i < this->caches.size(); i++){
+            delete this->caches[i];
+        }
+    }
+
+    // adds a geometry to the bank and returns it for reading its stats
+    tcModel* addCache(int numSets, int assoc, int replPolicy = TC_REPL_RANDOM){
+        tcParams p(numSets, assoc, this->builder.maxNumInsns, this->builder.maxNumBBs);
+        p.replPolicy = replPolicy;
+        p.classifyMisses = this->classifyMisses;
+        p.profileTraces = this->profileTraces;
+        return this->addCache(makeTraceCache(p));
+    }
+
+    // adds an already built model; it must cut traces the same way
+    tcModel* addCache(tcModel* cache){
+        assert(cache->maxNumInsns == this->builder.maxNumInsns);
+        assert(cache->maxNumBBs == this->builder.maxNumBBs);
+        this->caches.push_back(cache);
+        return cache;
+    }
+
+    // to be ran every instruction fetch
+    void tcInsnFetch(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        this->fetchInsnCount++;
+        this->builder.step(fetchAddr, isCondBranch, branchPred, *this);
+        if(this->stats && this->fetchInsnCount >= this->stats->nextDump){
+            this->dumpStats();
+        }
+    }
+
+    // same as calling tcInsnFetch on each of the n records in order. The
+    // batch is cut at interval boundaries so snapshots land exactly.
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n){
+        while(n > 0){
+            int run = n;
+            if(this->stats && this->stats->nextDump - this->fetchInsnCount < (uint64_t)run){
+                run = this->stats->nextDump - this->fetchInsnCount;
+            }
+            this->builder.stepRecords(records, run, *this);
+            this->fetchInsnCount += run;
+            if(this->stats && this->fetchInsnCount >= this->stats->nextDump){
+                this->dumpStats();
+            }
+            records += run;
+            n -= run;
+        }
+    }
+
+    // same as fetching every instruction of the n block records. Interval
+    // snapshots are taken at the end of the batch that crosses them.
+    void tcBlockFetchBatch(const tcBlockRecord* blocks, int n){
+        this->flushFetches();
+        this->fetchInsnCount += this->builder.stepBlocks(blocks, n, *this);
+        if(this->stats && this->fetchInsnCount >= this->stats->nextDump){
+            this->dumpStats();
+        }
+    }
+
+    // takes a snapshot of every member now
+    void dumpStats(){
+        for(size_t i = 0; i < this->caches.size(); i++){
+            this->caches[i]->fetchInsnCount = this->fetchInsnCount;
+        }
+        if(this->stats){
+            this->stats->snapshot(this->caches, this->fetchInsnCount);
+        }
+    }
+
+    // buffers one fetch and runs the buffer as a batch once it is full.
+    // Returns 1 when it ran a batch. Call flushFetches before reading
+    // stats; interval snapshots already account for the buffering.
+    int queueFetch(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        tcFetchRecord &r = this->pending[this->numPending++];
+        r.addr = fetchAddr;
+        r.isCondBranch = isCondBranch;
+        r.branchPred = branchPred;
+        if(this->numPending == tcBankBatchSize){
+            this->flushFetches();
+            return 1;
+        }
+        return 0;
+    }
+
+    void flushFetches(){
+        this->tcInsnFetchBatch(this->pending, this->numPending);
+        this->numPending = 0;
+    }
+
+    // a trace is only skipped if every member drops it
+    int dropsTrace(uint64_t fetchAddr, int branchPred){
+        for(size_t i = 0; i < this->caches.size(); i++){
+            if(!this->caches[i]->dropsTrace(fetchAddr, branchPred)){
+                return 0;
+            }
+        }
+        return !this->caches.empty();
+    }
+
+    void traceDropped(){
+        for(size_t i = 0; i < this->caches.size(); i++){
+            this->caches[i]->traceDropped();
+        }
+    }
+
+    void searchTraceCache(uint64_t fetchAddr, int branchFlags){
+        for(size_t i = 0; i < this->caches.size(); i++){
+            this->caches[i]->searchTraceCache(fetchAddr, branchFlags);
+        }
+    }
+
+    void completeTrace(const tcLine &trace){
+        for(size_t i = 0; i < this->caches.size(); i++){
+            this->caches[i]->completeTrace(trace);
+        }
+    }
+
+    // prints parameters and state of every member
+    void printCacheState(){
+        this->flushFetches();
+        for(size_t i = 0; i < this->caches.size(); i++){
+            this->caches[i]->fetchInsnCount = this->fetchInsnCount;
+            this->caches[i]->printCacheParameters();
+            this->caches[i]->printCacheState();
+            this->caches[i]->printDetailedStats(stdout);
+        }
+    }
+};
+
+// binary fetch trace files. A file is a 32-byte header followed by
+// numRecords tcFetchRecord entries (16 bytes each), all little endian:
+//   offset  0  char     magic[8]    "TCFETCH" and a NUL
+//   offset  8  uint32_t version     tcTraceVersion
+//   offset 12  uint32_t recordSize  sizeof(tcFetchRecord)
+//   offset 16  uint64_t numRecords
+//   offset 24  uint64_t reserved    0
+// Records are stored exactly as they are in memory, so a mapped file can
+// be handed to tcInsnFetchBatch without copying.
+static constexpr uint32_t tcTraceVersion = 1;
+
+class tcTraceHeader
+{
+  public:
+    char     magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t numRecords;
+    uint64_t reserved;
+
+    // Constructor
+    tcTraceHeader() {
+        memcpy(this->magic, "TCFETCH", 8);
+        this->version = tcTraceVersion;
+        this->recordSize = sizeof(tcFetchRecord);
+        this->numRecords = 0;
+        this->reserved = 0;
+    }
+
+    // 1 if this header describes a file we can read
+    int isValid() const {
+        return memcmp(this->magic, "TCFETCH", 8) == 0 &&
+               this->version == tcTraceVersion &&
+               this->recordSize == sizeof(tcFetchRecord);
+    }
+};
+static_assert(sizeof(tcTraceHeader) == 32, "trace header must stay 32 bytes");
+
+// writes a fetch trace file. The record count in the header is filled in
+// by close().
+class tcTraceWriter
+{
+  public:
+    FILE*    file;
+    uint64_t numRecords;
+
+    // Constructor
+    tcTraceWriter() {
+        this->file = NULL;
+        this->numRecords = 0;
+    }
+
+    ~tcTraceWriter() {
+        this->close();
+    }
+
+    // returns 0 on success, -1 if the file cannot be created
+    int open(const char* path){
+        this->file = fopen(path, "wb");
+        if(this->file == NULL){
+            fprintf(stderr, "tcTraceWriter: cannot create %s\n", path);
+            return -1;
+        }
+        this->numRecords = 0;
+        tcTraceHeader header;
+        fwrite(&header, sizeof(header), 1, this->file);
+        return 0;
+    }
+
+    void write(const tcFetchRecord* records, int n){
+        fwrite(records, sizeof(tcFetchRecord), n, this->file);
+        this->numRecords += n;
+    }
+
+    void close(){
+        if(this->file == NULL){
+            return;
+        }
+        tcTraceHeader header;
+        header.numRecords = this->numRecords;
+        fseek(this->file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, this->file);
+        fclose(this->file);
+        this->file = NULL;
+    }
+};
+
+// lock-free single-producer single-consumer ring of fetch records. The
+// producer only touches head and the consumer only touches tail; each
+// side keeps a private copy of the other's index and only rereads it when
+// the ring looks full (or empty), so the common case is one store.
+class tcFetchRing
+{
+  public:
+    tcFetchRecord* slots;
+    uint64_t       mask; // capacity - 1, the capacity is a power of two
+
+    alignas(64) std::atomic<uint64_t> head; // next slot to write
+    uint64_t cachedTail; // producer's copy of tail
+    alignas(64) std::atomic<uint64_t> tail; // next slot to read
+    uint64_t cachedHead; // consumer's copy of head
+
+    // Constructor
+    tcFetchRing(int capacityLog2) {
+        this->slots = new tcFetchRecord[1ULL << capacityLog2]();
+        this->mask = (1ULL << capacityLog2) - 1;
+        this->head.store(0);
+        this->tail.store(0);
+        this->cachedTail = 0;
+        this->cachedHead = 0;
+    }
+
+    ~tcFetchRing() {
+        delete[] this->slots;
+    }
+
+    // producer side; waits for the consumer when the ring is full
+    void push(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        uint64_t h = this->head.load(std::memory_order_relaxed);
+        while(h - this->cachedTail > this->mask){
+            this->cachedTail = this->tail.load(std::memory_order_acquire);
+            if(h - this->cachedTail > this->mask){
+                std::this_thread::yield();
+            }
+        }
+        tcFetchRecord &r = this->slots[h & this->mask];
+        r.addr = fetchAddr;
+        r.isCondBranch = isCondBranch;
+        r.branchPred = branchPred;
+        this->head.store(h + 1, std::memory_order_release);
+    }
+
+    // consumer side; points records at the oldest unread records and
+    // returns how many of them are contiguous, 0 if the ring is empty
+    int peek(const tcFetchRecord** records){
+        uint64_t t = this->tail.load(std::memory_order_relaxed);
+        if(t == this->cachedHead){
+            this->cachedHead = this->head.load(std::memory_order_acquire);
+        }
+        uint64_t avail = this->cachedHead - t;
+        uint64_t untilWrap = this->mask + 1 - (t & this->mask);
+        *records = this->slots + (t & this->mask);
+        return avail < untilWrap ? avail : untilWrap;
+    }
+
+    // consumer side; frees the n records returned by peek
+    void consume(int n){
+        this->tail.store(this->tail.load(std::memory_order_relaxed) + n,
+                         std::memory_order_release);
+    }
+
+    // 1 once the consumer has read everything pushed so far
+    int isEmpty(){
+        return this->tail.load(std::memory_order_acquire) ==
+               this->head.load(std::memory_order_acquire);
+    }
+};
+
+// records a fetch stream to a fetch trace file. record() only pushes
+// into a tcFetchRing; a background thread drains the ring into a
+// tcTraceWriter, so the caller never waits on the disk unless the ring
+// fills up.
+class tcFetchRecorder
+{
+  public:
+    tcFetchRing   ring;
+    tcTraceWriter writer;
+    std::thread   thread;
+    std::atomic<int> stopping;
+
+    // Constructor
+    tcFetchRecorder(int ringLog2 = 20) : ring(ringLog2) {
+        this->stopping.store(0);
+    }
+
+    ~tcFetchRecorder() {
+        this->stop();
+    }
+
+    // returns 0 on success, -1 if the file cannot be created
+    int start(const char* path){
+        if(this->writer.open(path) != 0){
+            return -1;
+        }
+        this->stopping.store(0);
+        this->thread = std::thread(&tcFetchRecorder::writerLoop, this);
+        return 0;
+    }
+
+    // to be ran every instruction fetch
+    void record(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        this->ring.push(fetchAddr, isCondBranch, branchPred);
+    }
+
+    // writes out everything recorded so far and closes the file
+    void stop(){
+        if(!this->thread.joinable()){
+            return;
+        }
+        this->stopping.store(1, std::memory_order_release);
+        this->thread.join();
+        this->writer.close();
+    }
+
+    void writerLoop(){
+        while(true){
+            const tcFetchRecord* records;
+            int n = this->ring.peek(&records);
+            if(n > 0){
+                this->writer.write(records, n);
+                this->ring.consume(n);
+            }else if(this->stopping.load(std::memory_order_acquire)){
+                // anything pushed before stop() is visible now
+                if(this->ring.isEmpty()){
+                    break;
+                }
+            }else{
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+};
+
+// runs a traceCacheBank on its own thread. The fetching thread only
+// pushes fetches into a tcFetchRing; the worker runs them through the
+// bank in batches, so interval snapshots are taken on the worker too.
+// Stats are only safe to read after flush() or stop().
+class tcBankWorker
+{
+  public:
+    traceCacheBank* bank; // not owned
+    tcFetchRing     ring;
+    std::thread     thread;
+    std::atomic<int> stopping;
+
+    // Constructor
+    tcBankWorker(traceCacheBank* bank, int ringLog2 = 16) : ring(ringLog2) {
+        this->bank = bank;
+        this->stopping.store(0);
+        this->thread = std::thread(&tcBankWorker::workerLoop, this);
+    }
+
+    ~tcBankWorker() {
+        this->stop();
+    }
+
+    // to be ran every instruction fetch
+    void push(uint64_t fetchAddr, int isCondBranch, int branchPred){
+        this->ring.push(fetchAddr, isCondBranch, branchPred);
+    }
+
+    // waits until the worker has run every fetch pushed so far. Records
+    // are only consumed once the bank has run them, so an empty ring
+    // means the bank is up to date.
+    void flush(){
+        while(!this->ring.isEmpty()){
+            std::this_thread::yield();
+        }
+    }
+
+    // flushes and ends the worker thread
+    void stop(){
+        if(!this->thread.joinable()){
+            return;
+        }
+        this->stopping.store(1, std::memory_order_release);
+        this->thread.join();
+    }
+
+    void workerLoop(){
+        while(true){
+            const tcFetchRecord* records;
+            int n = this->ring.peek(&records);
+            if(n > 0){
+                this->bank->tcInsnFetchBatch(records, n);
+                this->ring.consume(n);
+            }else if(this->stopping.load(std::memory_order_acquire)){
+                if(this->ring.isEmpty()){
+                    break;
+                }
+            }else{
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
+};
 
+#endif // __TRACECACHE_CC__
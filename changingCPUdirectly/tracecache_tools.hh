@@ -0,0 +1,854 @@
+#ifndef __TRACECACHE_TOOLS_HH__
+#define __TRACECACHE_TOOLS_HH__
+
+// offline tooling around the trace cache models: the fetch trace readers,
+// the compressed trace codec, and the parallel sweep and partitioned
+// drivers. Only the standalone simulators (traceCache.cc, tcSweep.cc)
+// include this; gem5 only needs tracecache.cc.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tracecache.cc"
+
+// maps a fetch trace file read-only. The records are used in place; the
+// kernel is told they will be read front to back, and asked for huge
+// pages where it supports them for file mappings.
+class tcTraceReader
+{
+  public:
+    int    fd;
+    void*  map;
+    size_t mapSize;
+    const tcFetchRecord* records; // numRecords records inside the mapping
+    uint64_t numRecords;
+
+    // Constructor
+    tcTraceReader() {
+        this->fd = -1;
+        this->map = NULL;
+        this->mapSize = 0;
+        this->records = NULL;
+        this->numRecords = 0;
+    }
+
+    ~tcTraceReader() {
+        this->close();
+    }
+
+    // returns 0 on success, -1 if the file is missing or not a trace
+    int open(const char* path){
+        this->fd = ::open(path, O_RDONLY);
+        if(this->fd < 0){
+            fprintf(stderr, "tcTraceReader: cannot open %s\n", path);
+            return -1;
+        }
+        struct stat st;
+        if(fstat(this->fd, &st) != 0 || (size_t)st.st_size < sizeof(tcTraceHeader)){
+            fprintf(stderr, "tcTraceReader: %s is too short\n", path);
+            this->close();
+            return -1;
+        }
+        this->mapSize = st.st_size;
+        this->map = mmap(NULL, this->mapSize, PROT_READ, MAP_PRIVATE, this->fd, 0);
+        if(this->map == MAP_FAILED){
+            fprintf(stderr, "tcTraceReader: cannot map %s\n", path);
+            this->map = NULL;
+            this->close();
+            return -1;
+        }
+        madvise(this->map, this->mapSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(this->map, this->mapSize, MADV_HUGEPAGE);
+#endif
+
+        const tcTraceHeader* header = (const tcTraceHeader*)this->map;
+        uint64_t maxRecords = (this->mapSize - sizeof(tcTraceHeader)) / sizeof(tcFetchRecord);
+        if(!header->isValid() || header->numRecords > maxRecords){
+            fprintf(stderr, "tcTraceReader: %s is not a fetch trace\n", path);
+            this->close();
+            return -1;
+        }
+        this->records = (const tcFetchRecord*)(header + 1);
+        this->numRecords = header->numRecords;
+        return 0;
+    }
+
+    void close(){
+        if(this->map != NULL){
+            munmap(this->map, this->mapSize);
+            this->map = NULL;
+        }
+        if(this->fd >= 0){
+            ::close(this->fd);
+            this->fd = -1;
+        }
+        this->records = NULL;
+        this->numRecords = 0;
+    }
+};
+
+// feeds every record of a mapped trace to a model or a traceCacheBank,
+// in batches that point straight into the mapping
+template <class Model>
+void tcReplayTrace(const tcTraceReader &reader, Model &model){
+    const uint64_t chunk = 1 << 20;
+    for(uint64_t i = 0; i < reader.numRecords; i += chunk){
+        uint64_t n = reader.numRecords - i < chunk ? reader.numRecords - i : chunk;
+        model.tcInsnFetchBatch(reader.records + i, (int)n);
+    }
+}
+
+// compressed fetch trace files. Records are grouped into blocks of up to
+// blockRecords fetches that each decode on their own, so blocks can be
+// decoded in parallel or skipped to. Within a block
+//   - the control and prediction flags of every record are bit-packed,
+//     two bits per record, four records per byte (tcZFlagBits)
+//   - addresses are a list of (delta, count) pairs, both varints with the
+//     delta zig-zag encoded: count records, each delta past the previous
+//     address. A fall-through run of fixed-size instructions is one pair.
+// File layout, all little endian:
+//   tcZTraceHeader (48 bytes)
+//   blocks, each a tcZBlockHeader (16 bytes), its flag bytes and its
+//     address bytes; the first delta of a block is taken from address 0
+//   numBlocks uint64_t offsets of the blocks from the start of the file,
+//     starting at indexOffset, which is 8-byte aligned
+static constexpr uint32_t tcZTraceVersion = 1;
+
+class tcZTraceHeader
+{
+  public:
+    char     magic[8];
+    uint32_t version;
+    uint32_t blockRecords; // max records per block
+    uint64_t numRecords;
+    uint64_t numBlocks;
+    uint64_t indexOffset; // file offset of the block offset table
+    uint64_t reserved;
+
+    // Constructor
+    tcZTraceHeader() {
+        memcpy(this->magic, "TCZTRACE", 8);
+        this->version = tcZTraceVersion;
+        this->blockRecords = 0;
+        this->numRecords = 0;
+        this->numBlocks = 0;
+        this->indexOffset = 0;
+        this->reserved = 0;
+    }
+
+    // 1 if this header describes a file we can read
+    int isValid() const {
+        return memcmp(this->magic, "TCZTRACE", 8) == 0 &&
+               this->version == tcZTraceVersion && this->blockRecords > 0;
+    }
+};
+static_assert(sizeof(tcZTraceHeader) == 48, "compressed header must stay 48 bytes");
+
+class tcZBlockHeader
+{
+  public:
+    uint32_t numRecords;
+    uint32_t flagBytes;
+    uint32_t addrBytes;
+    uint32_t reserved;
+};
+static_assert(sizeof(tcZBlockHeader) == 16, "block header must stay 16 bytes");
+
+// bit 0 of each record's pair is isCondBranch, bit 1 is branchPred
+static constexpr int tcZFlagBits = 2;
+
+inline uint64_t tcZigZag(int64_t v){
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t tcUnZigZag(uint64_t v){
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+inline void tcPutVarint(vector<uint8_t> &out, uint64_t v){
+    while(v >= 0x80){
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+// reads a varint at p, never past end, and advances p
+inline uint64_t tcGetVarint(const uint8_t* &p, const uint8_t* end){
+    uint64_t v = 0;
+    int shift = 0;
+    while(p < end && shift < 64){
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if((b & 0x80) == 0){
+            break;
+        }
+        shift += 7;
+    }
+    return v;
+}
+
+// encodes n records as one block and appends it to out
+inline void tcZEncodeBlock(const tcFetchRecord* records, int n, vector<uint8_t> &out){
+    vector<uint8_t> flags((n + 3) / 4, 0);
+    for(int i = 0; i < n; i++){
+        int bits = (records[i].isCondBranch & 1) | (records[i].branchPred & 1) << 1;
+        flags[i / 4] |= bits << (tcZFlagBits * (i % 4));
+    }
+
+    vector<uint8_t> addrs;
+    uint64_t prev = 0;
+    int i = 0;
+    while(i < n){
+        int64_t delta = (int64_t)(records[i].addr - prev);
+        int count = 1;
+        while(i + count < n &&
+              (int64_t)(records[i + count].addr - records[i + count - 1].addr) == delta){
+            count++;
+        }
+        tcPutVarint(addrs, tcZigZag(delta));
+        tcPutVarint(addrs, count);
+        prev = records[i + count - 1].addr;
+        i += count;
+    }
+
+    tcZBlockHeader header;
+    header.numRecords = n;
+    header.flagBytes = flags.size();
+    header.addrBytes = addrs.size();
+    header.reserved = 0;
+    const uint8_t* h = (const uint8_t*)&header;
+    out.insert(out.end(), h, h + sizeof(header));
+    out.insert(out.end(), flags.begin(), flags.end());
+    out.insert(out.end(), addrs.begin(), addrs.end());
+}
+
+// decodes the block at p (at most size bytes) into out, which must have
+// room for the block's records. Returns the number of records decoded.
+inline int tcZDecodeBlock(const uint8_t* p, size_t size, tcFetchRecord* out){
+    if(size < sizeof(tcZBlockHeader)){
+        return 0;
+    }
+    tcZBlockHeader header;
+    memcpy(&header, p, sizeof(header));
+    if(sizeof(header) + (size_t)header.flagBytes + header.addrBytes > size ||
+       header.flagBytes < (header.numRecords + 3) / 4){
+        return 0;
+    }
+    const uint8_t* flags = p + sizeof(header);
+    const uint8_t* addrs = flags + header.flagBytes;
+    const uint8_t* addrEnd = addrs + header.addrBytes;
+    int n = header.numRecords;
+
+    // unpack the flags; the loop has no branches, so it vectorizes
+    for(int i = 0; i < n; i++){
+        int bits = flags[i / 4] >> (tcZFlagBits * (i % 4));
+        out[i].isCondBranch = bits & 1;
+        out[i].branchPred = (bits >> 1) & 1;
+        memset(out[i].pad, 0, sizeof(out[i].pad));
+    }
+
+    uint64_t addr = 0;
+    int i = 0;
+    while(i < n && addrs < addrEnd){
+        uint64_t delta = (uint64_t)tcUnZigZag(tcGetVarint(addrs, addrEnd));
+        uint64_t count = tcGetVarint(addrs, addrEnd);
+        for(uint64_t c = 0; c < count && i < n; c++){
+            addr += delta;
+            out[i++].addr = addr;
+        }
+    }
+    return i;
+}
+
+// writes a compressed fetch trace file, one block at a time
+class tcZTraceWriter
+{
+  public:
+    FILE*    file;
+    uint32_t blockRecords;
+    vector<tcFetchRecord> pending; // records of the block being filled
+    vector<uint64_t> blockOffsets;
+    vector<uint8_t> encoded; // scratch for one encoded block
+    uint64_t numRecords;
+    uint64_t offset; // current file offset
+
+    // Constructor
+    tcZTraceWriter() {
+        this->file = NULL;
+        this->blockRecords = 0;
+        this->numRecords = 0;
+        this->offset = 0;
+    }
+
+    ~tcZTraceWriter() {
+        this->close();
+    }
+
+    // returns 0 on success, -1 if the file cannot be created
+    int open(const char* path, uint32_t blockRecords = 65536){
+        this->file = fopen(path, "wb");
+        if(this->file == NULL){
+            fprintf(stderr, "tcZTraceWriter: cannot create %s\n", path);
+            return -1;
+        }
+        this->blockRecords = blockRecords;
+        this->pending.clear();
+        this->blockOffsets.clear();
+        this->numRecords = 0;
+        tcZTraceHeader header;
+        fwrite(&header, sizeof(header), 1, this->file);
+        this->offset = sizeof(header);
+        return 0;
+    }
+
+    void write(const tcFetchRecord* records, int n){
+        for(int i = 0; i < n; i++){
+            this->pending.push_back(records[i]);
+            if(this->pending.size() == this->blockRecords){
+                this->writeBlock();
+            }
+        }
+    }
+
+    void writeBlock(){
+        if(this->pending.empty()){
+            return;
+        }
+        this->encoded.clear();
+        tcZEncodeBlock(this->pending.data(), this->pending.size(), this->encoded);
+        fwrite(this->encoded.data(), 1, this->encoded.size(), this->file);
+        this->blockOffsets.push_back(this->offset);
+        this->offset += this->encoded.size();
+        this->numRecords += this->pending.size();
+        this->pending.clear();
+    }
+
+    void close(){
+        if(this->file == NULL){
+            return;
+        }
+        this->writeBlock();
+        // the offset table is read in place, so align it
+        while(this->offset % sizeof(uint64_t)){
+            fputc(0, this->file);
+            this->offset++;
+        }
+        tcZTraceHeader header;
+        header.blockRecords = this->blockRecords;
+        header.numRecords = this->numRecords;
+        header.numBlocks = this->blockOffsets.size();
+        header.indexOffset = this->offset;
+        fwrite(this->blockOffsets.data(), sizeof(uint64_t), this->blockOffsets.size(), this->file);
+        fseek(this->file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, this->file);
+        fclose(this->file);
+        this->file = NULL;
+    }
+};
+
+// maps a compressed fetch trace file read-only. decodeBlock may be
+// called for different blocks from different threads.
+class tcZTraceReader
+{
+  public:
+    int    fd;
+    void*  map;
+    size_t mapSize;
+    const uint8_t* base;
+    const uint64_t* blockOffsets;
+    uint64_t indexOffset; // end of the last block
+    uint64_t numBlocks;
+    uint64_t numRecords;
+    uint32_t blockRecords;
+
+    // Constructor
+    tcZTraceReader() {
+        this->fd = -1;
+        this->map = NULL;
+        this->mapSize = 0;
+        this->base = NULL;
+        this->blockOffsets = NULL;
+        this->indexOffset = 0;
+        this->numBlocks = 0;
+        this->numRecords = 0;
+        this->blockRecords = 0;
+    }
+
+    ~tcZTraceReader() {
+        this->close();
+    }
+
+    // returns 0 on success, -1 if the file is missing or not a trace
+    int open(const char* path){
+        this->fd = ::open(path, O_RDONLY);
+        if(this->fd < 0){
+            fprintf(stderr, "tcZTraceReader: cannot open %s\n", path);
+            return -1;
+        }
+        struct stat st;
+        if(fstat(this->fd, &st) != 0 || (size_t)st.st_size < sizeof(tcZTraceHeader)){
+            fprintf(stderr, "tcZTraceReader: %s is too short\n", path);
+            this->close();
+            return -1;
+        }
+        this->mapSize = st.st_size;
+        this->map = mmap(NULL, this->mapSize, PROT_READ, MAP_PRIVATE, this->fd, 0);
+        if(this->map == MAP_FAILED){
+            fprintf(stderr, "tcZTraceReader: cannot map %s\n", path);
+            this->map = NULL;
+            this->close();
+            return -1;
+        }
+        madvise(this->map, this->mapSize, MADV_SEQUENTIAL);
+
+        this->base = (const uint8_t*)this->map;
+        const tcZTraceHeader* header = (const tcZTraceHeader*)this->map;
+        if(!header->isValid() || header->indexOffset > this->mapSize ||
+           header->indexOffset % sizeof(uint64_t) != 0 ||
+           header->numBlocks > (this->mapSize - header->indexOffset) / sizeof(uint64_t)){
+            fprintf(stderr, "tcZTraceReader: %s is not a compressed fetch trace\n", path);
+            this->close();
+            return -1;
+        }
+        this->blockOffsets = (const uint64_t*)(this->base + header->indexOffset);
+        this->indexOffset = header->indexOffset;
+        this->numBlocks = header->numBlocks;
+        this->numRecords = header->numRecords;
+        this->blockRecords = header->blockRecords;
+        return 0;
+    }
+
+    // decodes block b into out (room for blockRecords records) and
+    // returns its number of records
+    int decodeBlock(uint64_t b, tcFetchRecord* out) const {
+        // a block ends where the next one (or the offset table) starts
+        uint64_t start = this->blockOffsets[b];
+        uint64_t end = b + 1 < this->numBlocks ? this->blockOffsets[b + 1]
+                                               : this->indexOffset;
+        if(start + sizeof(tcZBlockHeader) > end || end > this->indexOffset){
+            return 0;
+        }
+        tcZBlockHeader header;
+        memcpy(&header, this->base + start, sizeof(header));
+        if(header.numRecords > this->blockRecords){
+            return 0;
+        }
+        return tcZDecodeBlock(this->base + start, end - start, out);
+    }
+
+    void close(){
+        if(this->map != NULL){
+            munmap(this->map, this->mapSize);
+            this->map = NULL;
+        }
+        if(this->fd >= 0){
+            ::close(this->fd);
+            this->fd = -1;
+        }
+        this->base = NULL;
+        this->blockOffsets = NULL;
+        this->numBlocks = 0;
+        this->numRecords = 0;
+    }
+};
+
+// decodes a compressed trace block by block and feeds each block to a
+// model or a traceCacheBank as one batch
+template <class Model>
+void tcReplayTrace(const tcZTraceReader &reader, Model &model){
+    vector<tcFetchRecord> records(reader.blockRecords);
+    for(uint64_t b = 0; b < reader.numBlocks; b++){
+        int n = reader.decodeBlock(b, records.data());
+        model.tcInsnFetchBatch(records.data(), n);
+    }
+}
+
+// runs a fixed list of independent tasks on numThreads threads. Tasks
+// are dealt round robin into one deque per thread; a thread pops from the
+// back of its own deque and, once that is empty, steals from the front of
+// the others. Tasks never add tasks, so a thread that finds every deque
+// empty is done.
+class tcWorkStealingPool
+{
+  public:
+    class alignas(64) taskQueue
+    {
+      public:
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    int numThreads;
+
+    // Constructor. numThreads 0 means one per host core.
+    tcWorkStealingPool(int numThreads = 0) {
+        if(numThreads <= 0){
+            numThreads = std::thread::hardware_concurrency();
+        }
+        this->numThreads = numThreads > 0 ? numThreads : 1;
+    }
+
+    // runs every task once and returns when all are done
+    void run(const vector<std::function<void()>> &tasks){
+        int n = this->numThreads < (int)tasks.size() ? this->numThreads : (int)tasks.size();
+        if(n <= 1){
+            for(size_t i = 0; i < tasks.size(); i++){
+                tasks[i]();
+            }
+            return;
+        }
+        vector<taskQueue> queues(n);
+        for(size_t i = 0; i < tasks.size(); i++){
+            queues[i % n].tasks.push_back(i);
+        }
+        vector<std::thread> threads;
+        for(int t = 0; t < n; t++){
+            threads.push_back(std::thread([&tasks, &queues, n, t](){
+                int task;
+                while((task = tcWorkStealingPool::next(queues, n, t)) >= 0){
+                    tasks[task]();
+                }
+            }));
+        }
+        for(int t = 0; t < n; t++){
+            threads[t].join();
+        }
+    }
+
+    // returns thread t's next task, or -1 when every queue is empty
+    static int next(vector<taskQueue> &queues, int n, int t){
+        {
+            std::lock_guard<std::mutex> guard(queues[t].lock);
+            if(!queues[t].tasks.empty()){
+                int task = queues[t].tasks.back();
+                queues[t].tasks.pop_back();
+                return task;
+            }
+        }
+        for(int i = 1; i < n; i++){
+            taskQueue &victim = queues[(t + i) % n];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(!victim.tasks.empty()){
+                int task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+        return -1;
+    }
+};
+
+// one geometry of a design-space sweep and, once run, its results
+class tcSweepPoint
+{
+  public:
+    // parameters
+    int numSets;
+    int assoc;
+    int maxNumInsns;
+    int maxNumBBs;
+    int replPolicy; // one of tcReplPolicyType, except TC_REPL_OPT
+    int sampleSets; // see tcParams
+    int sampleHashed;
+
+    // results
+    uint64_t hitCount;
+    uint64_t missCount;
+    uint64_t hitInsnCount;
+    double   hitRate; // estimated when sampling
+    double   hitRateError; // half width of the 95% confidence interval
+    double   seconds; // time of the task that ran this point
+
+    // Constructor
+    tcSweepPoint(int numSets, int assoc, int numInsns, int numBBs, int replPolicy) {
+        this->numSets = numSets;
+        this->assoc = assoc;
+        this->maxNumInsns = numInsns;
+        this->maxNumBBs = numBBs;
+        this->replPolicy = replPolicy;
+        this->sampleSets = 0;
+        this->sampleHashed = 0;
+        this->hitCount = 0;
+        this->missCount = 0;
+        this->hitInsnCount = 0;
+        this->hitRate = 0;
+        this->hitRateError = 0;
+        this->seconds = 0;
+    }
+};
+
+// runs every point of a sweep over the trace read by reader, on a
+// tcWorkStealingPool of numThreads threads. Points that cut traces the
+// same way (maxNumInsns, maxNumBBs) are grouped up to pointsPerTask into
+// one traceCacheBank, so a task streams the shared, read-only trace once
+// for all of its points. The reader must allow concurrent replays, which
+// both tcTraceReader and tcZTraceReader do.
+template <class Reader>
+void tcRunSweep(const Reader &reader, vector<tcSweepPoint> &points,
+                int numThreads = 0, int pointsPerTask = 4){
+    // group the points by builder parameters, keeping their order within
+    vector<int> order(points.size());
+    for(size_t i = 0; i < points.size(); i++){
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&points](int a, int b){
+        if(points[a].maxNumInsns != points[b].maxNumInsns){
+            return points[a].maxNumInsns < points[b].maxNumInsns;
+        }
+        return points[a].maxNumBBs < points[b].maxNumBBs;
+    });
+
+    vector<std::function<void()>> tasks;
+    size_t i = 0;
+    while(i < order.size()){
+        vector<int> group;
+        const tcSweepPoint &first = points[order[i]];
+        while(i < order.size() && (int)group.size() < pointsPerTask &&
+              points[order[i]].maxNumInsns == first.maxNumInsns &&
+              points[order[i]].maxNumBBs == first.maxNumBBs){
+            group.push_back(order[i++]);
+        }
+        tasks.push_back([&reader, &points, group](){
+            auto start = std::chrono::steady_clock::now();
+            const tcSweepPoint &p0 = points[group[0]];
+            traceCacheBank bank(p0.maxNumInsns, p0.maxNumBBs);
+            for(size_t g = 0; g < group.size(); g++){
+                const tcSweepPoint &pt = points[group[g]];
+                tcParams p(pt.numSets, pt.assoc, pt.maxNumInsns, pt.maxNumBBs);
+                p.replPolicy = pt.replPolicy;
+                p.sampleSets = pt.sampleSets;
+                p.sampleHashed = pt.sampleHashed;
+                bank.addCache(makeTraceCache(p));
+            }
+            tcReplayTrace(reader, bank);
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            for(size_t g = 0; g < group.size(); g++){
+                tcSweepPoint &pt = points[group[g]];
+                pt.hitCount = bank.caches[g]->globalHitCount;
+                pt.missCount = bank.caches[g]->globalMissCount;
+                pt.hitInsnCount = bank.caches[g]->globalHitInsnCount;
+                bank.caches[g]->hitRateEstimate(&pt.hitRate, &pt.hitRateError);
+                pt.seconds = seconds;
+            }
+        });
+    }
+
+    tcWorkStealingPool pool(numThreads);
+    pool.run(tasks);
+}
+
+// writes the results of a sweep as CSV, one row per point
+inline void tcPrintSweep(FILE* out, const vector<tcSweepPoint> &points){
+    fprintf(out, "sets,assoc,insns,bbs,policy,hits,misses,hitRate,hitInsns,seconds,"
+                 "sampleSets,hitRateError\n");
+    for(size_t i = 0; i < points.size(); i++){
+        const tcSweepPoint &p = points[i];
+        fprintf(out, "%d,%d,%d,%d,%s,%lu,%lu,%.6f,%lu,%.3f,%d,%.6f\n",
+                p.numSets, p.assoc, p.maxNumInsns, p.maxNumBBs,
+                tcReplPolicyNames[p.replPolicy], (unsigned long)p.hitCount,
+                (unsigned long)p.missCount, p.hitRate,
+                (unsigned long)p.hitInsnCount, p.seconds, p.sampleSets, p.hitRateError);
+    }
+}
+
+// simulates one large traceCache with its sets split across threads. The
+// builder only couples consecutive fetches, and every lookup is followed
+// by the completion of that same trace before the next lookup, so the
+// stream is first cut into completed traces here, serially. Each trace
+// goes to the partition that owns its set; partition p owns a contiguous
+// range of sets, and so a disjoint slice of line[], through a view of the
+// cache. The partitions of a batch run on a tcWorkStealingPool. Each set
+// sees its traces in stream order, so lines and counters come out
+// bit-identical to feeding the stream to the cache itself. Use it as a
+// model (tcInsnFetchBatch, or tcReplayTrace) and call finish() once at
+// the end.
+class tcPartitionedCache
+{
+  public:
+    traceCache* cache; // not owned, takes the merged counters
+    traceBuilder builder;
+    tcWorkStealingPool pool;
+    int numPartitions;
+    vector<traceCache*> views; // one per partition
+    // traces of the current batch per partition. valid is 1 for complete
+    // traces and 0 for the last trace of the stream if it was looked up
+    // but never completed.
+    vector<vector<tcLine>> traces;
+#ifdef TC_DETAILED_STATS
+    // the serial lookup number of each trace, the clock of the lifetimes
+    vector<vector<uint64_t>> lookupNumbers;
+    uint64_t numLookups; // lookups the cache has counted so far
+#endif
+    size_t numTraces; // traces collected and not run yet
+    uint64_t fetchInsnCount;
+
+    // traces collected before the partitions run; batches from the
+    // readers can be small, and every run starts the pool's threads
+    static constexpr size_t runTraceCount = 1 << 18;
+
+    // Constructor. partitionsPerThread > 1 leaves the pool room to even
+    // out sets that see more traces than others.
+    tcPartitionedCache(traceCache* cache, int numThreads = 0, int partitionsPerThread = 4)
+        : builder(cache->maxNumInsns, cache->maxNumBBs), pool(numThreads) {
+        this->cache = cache;
+        this->numPartitions = this->pool.numThreads * partitionsPerThread;
+        if(this->numPartitions > cache->numSets){
+            this->numPartitions = cache->numSets;
+        }
+        for(int p = 0; p < this->numPartitions; p++){
+            this->views.push_back(new traceCache(cache));
+        }
+        this->traces.resize(this->numPartitions);
+#ifdef TC_DETAILED_STATS
+        this->lookupNumbers.resize(this->numPartitions);
+        this->numLookups = cache->detail.lookups;
+#endif
+        this->numTraces = 0;
+        this->fetchInsnCount = 0;
+    }
+
+    ~tcPartitionedCache() {
+        for(size_t p = 0; p < this->views.size(); p++){
+            delete this->views[p];
+        }
+    }
+
+    // queues a trace on the partition of its set
+    void addTrace(const tcLine &trace){
+        int set = tcSetIndex(this->cache->indexFunc, trace.tagAddr, trace.branchFlags,
+                             this->cache->numIndexBits, this->cache->indexShift);
+        int p = (int)((int64_t)set * this->numPartitions / this->cache->numSets);
+        this->traces[p].push_back(trace);
+#ifdef TC_DETAILED_STATS
+        // lookups of sets left out of the sample are not counted
+        this->lookupNumbers[p].push_back(this->numLookups);
+        if(this->cache->setSampled(set)){
+            this->numLookups++;
+        }
+#endif
+    }
+
+    // cuts the records into traces, running them once enough are collected
+    void tcInsnFetchBatch(const tcFetchRecord* records, int n){
+        this->builder.stepRecords(records, n, *this);
+        this->fetchInsnCount += n;
+        if(this->numTraces >= runTraceCount){
+            this->runTraces();
+        }
+    }
+
+    // traces of unsampled sets are skipped before they are collected
+    int dropsTrace(uint64_t fetchAddr, int branchPred){
+        return this->cache->dropsTrace(fetchAddr, branchPred);
+    }
+
+    void traceDropped(){
+        this->cache->traceDropped();
+    }
+
+    // the lookup is issued along with the completion, see completeTrace
+    void searchTraceCache(uint64_t fetchAddr, int branchFlags){}
+
+    void completeTrace(const tcLine &trace){
+        this->addTrace(trace);
+        this->numTraces++;
+    }
+
+    // runs the traces collected so far, each partition on its own view
+    void runTraces(){
+        vector<std::function<void()>> tasks;
+        for(int p = 0; p < this->numPartitions; p++){
+            if(this->traces[p].empty()){
+                continue;
+            }
+            tasks.push_back([this, p](){
+                traceCache* view = this->views[p];
+                vector<tcLine> &t = this->traces[p];
+                for(size_t i = 0; i < t.size(); i++){
+#ifdef TC_DETAILED_STATS
+                    view->detail.lookups = this->lookupNumbers[p][i];
+#endif
+                    view->searchTraceCache(t[i].tagAddr, t[i].branchFlags);
+                    if(t[i].valid){
+                        view->completeTrace(t[i]);
+                    }
+                }
+                t.clear();
+#ifdef TC_DETAILED_STATS
+                this->lookupNumbers[p].clear();
+#endif
+            });
+        }
+        this->pool.run(tasks);
+        this->numTraces = 0;
+    }
+
+    // runs what is left, including the lookup of a trace the stream ended
+    // in the middle of, and adds the counters of every view to the cache's
+    void finish(){
+        if(this->builder.buildingTrace && !this->builder.lookupPending
+           && !this->builder.skippingTrace){
+            tcLine last = this->builder.buildLine;
+            last.valid = 0;
+            this->addTrace(last);
+        }
+        this->runTraces();
+        this->cache->fetchInsnCount += this->fetchInsnCount;
+        this->fetchInsnCount = 0;
+        for(size_t p = 0; p < this->views.size(); p++){
+            traceCache* v = this->views[p];
+            this->cache->globalHitCount += v->globalHitCount;
+            this->cache->globalMissCount += v->globalMissCount;
+            this->cache->globalHitInsnCount += v->globalHitInsnCount;
+            this->cache->globalPartialHitCount += v->globalPartialHitCount;
+            this->cache->globalPartialInsnCount += v->globalPartialInsnCount;
+            this->cache->sampleSkipCount += v->sampleSkipCount;
+            v->sampleSkipCount = 0;
+            v->globalHitCount = 0;
+            v->globalMissCount = 0;
+            v->globalHitInsnCount = 0;
+            v->globalPartialHitCount = 0;
+            v->globalPartialInsnCount = 0;
+#ifdef TC_DETAILED_STATS
+            this->cache->detail.merge(v->detail);
+#endif
+        }
+    }
+};
+
+// runs one sweep point as a single traceCache split across numThreads
+// threads by tcPartitionedCache
+template <class Reader>
+void tcRunPartitioned(const Reader &reader, tcSweepPoint &point, int numThreads = 0){
+    auto start = std::chrono::steady_clock::now();
+    tcParams p(point.numSets, point.assoc, point.maxNumInsns, point.maxNumBBs);
+    p.replPolicy = point.replPolicy;
+    p.sampleSets = point.sampleSets;
+    p.sampleHashed = point.sampleHashed;
+    traceCache cache(p);
+    tcPartitionedCache run(&cache, numThreads);
+    tcReplayTrace(reader, run);
+    run.finish();
+    point.hitCount = cache.globalHitCount;
+    point.missCount = cache.globalMissCount;
+    point.hitInsnCount = cache.globalHitInsnCount;
+    cache.hitRateEstimate(&point.hitRate, &point.hitRateError);
+    point.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // __TRACECACHE_TOOLS_HH__
@@ -0,0 +1,130 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// the trace cache models shared with the gem5 simple CPU, and the
+// offline trace readers and drivers around them
+#include "changingCPUdirectly/tracecache_tools.hh"
+
+using namespace std;
+
+// benchmarks for the optional trace cache modes, on synthetic fetch
+// streams. Each case times the same stream through a plain traceCache and
+// through one with the option turned on, and prints the ratio; the best
+// of a few runs is taken to keep host noise out.
+
+void usage(const char* prog){
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n N    fetches per stream (default 20000000)\n"
+            "  -r N    runs per case, the fastest counts (default 3)\n",
+            prog);
+}
+
+// every trace starts at a new address, so every lookup misses
+void allMissStream(vector<tcFetchRecord> &records){
+    for(size_t i = 0; i < records.size(); i++){
+        records[i].addr = 4*i;
+        records[i].isCondBranch = i % 5 == 0;
+        records[i].branchPred = (i / 5) & 1;
+    }
+}
+
+// traces of five instructions starting at one of numPCs addresses, with
+// a random prediction at the starting branch
+void randomPCStream(vector<tcFetchRecord> &records, int numPCs){
+    uint64_t x = 1;
+    uint64_t pc = 0;
+    for(size_t i = 0; i < records.size(); i++){
+        int pred = 0;
+        if(i % 5 == 0){
+            x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            pc = 4096*((x >> 33) % numPCs);
+            pred = (x >> 20) & 1;
+        }else{
+            pc += 4;
+        }
+        records[i].addr = pc;
+        records[i].isCondBranch = i % 5 == 0;
+        records[i].branchPred = pred;
+    }
+}
+
+// seconds to run records through a fresh cache built from p
+double timeRun(const tcParams &p, const vector<tcFetchRecord> &records, int runs){
+    double best = 0;
+    for(int r = 0; r < runs; r++){
+        traceCache cache(p);
+        auto start = std::chrono::steady_clock::now();
+        cache.tcInsnFetchBatch(records.data(), records.size());
+        double t = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        if(r == 0 || t < best){
+            best = t;
+        }
+    }
+    return best;
+}
+
+// prints how much slower the stream runs with classifyMisses set
+void benchClassify(const char* stream, const vector<tcFetchRecord> &records,
+                   int numSets, int assoc, int runs){
+    tcParams p(numSets, assoc, 16, 1);
+    double plain = timeRun(p, records, runs);
+    p.classifyMisses = 1;
+    double classified = timeRun(p, records, runs);
+    printf("classify,%s,%d,%d,%.3f,%.3f,%.2f\n", stream, numSets, assoc,
+           plain, classified, classified / plain);
+}
+
+// prints how much of the time is left when modelling 1 in 32 sets
+void benchSample(const char* stream, const vector<tcFetchRecord> &records,
+                 int numSets, int assoc, int runs){
+    tcParams p(numSets, assoc, 16, 1);
+    double plain = timeRun(p, records, runs);
+    p.sampleSets = 32;
+    p.sampleHashed = 1;
+    double sampled = timeRun(p, records, runs);
+    printf("sample,%s,%d,%d,%.3f,%.3f,%.2f\n", stream, numSets, assoc,
+           plain, sampled, sampled / plain);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t numFetches = 20000000;
+    int runs = 3;
+    for(int i = 1; i < argc; i++){
+        if(i + 1 < argc && strcmp(argv[i], "-n") == 0){
+            numFetches = strtoull(argv[++i], NULL, 0);
+        }else if(i + 1 < argc && strcmp(argv[i], "-r") == 0){
+            runs = atoi(argv[++i]);
+        }else{
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(numFetches == 0 || runs <= 0){
+        usage(argv[0]);
+        return 1;
+    }
+
+    vector<tcFetchRecord> allMiss(numFetches);
+    vector<tcFetchRecord> pcs20k(numFetches);
+    vector<tcFetchRecord> pcs2k(numFetches);
+    allMissStream(allMiss);
+    randomPCStream(pcs20k, 20000);
+    randomPCStream(pcs2k, 2000);
+
+    printf("bench,stream,sets,assoc,baseSeconds,seconds,ratio\n");
+    int geometries[2][2] = {{64, 4}, {1024, 4}};
+    for(int g = 0; g < 2; g++){
+        int numSets = geometries[g][0];
+        int assoc = geometries[g][1];
+        benchClassify("allMiss", allMiss, numSets, assoc, runs);
+        benchClassify("20kPCs", pcs20k, numSets, assoc, runs);
+        benchClassify("2kPCs", pcs2k, numSets, assoc, runs);
+    }
+    benchSample("allMiss", allMiss, 65536, 4, runs);
+    benchSample("20kPCs", pcs20k, 65536, 4, runs);
+    return 0;
+}
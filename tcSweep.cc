@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// the trace cache models shared with the gem5 simple CPU, and the
+// offline trace readers and drivers around them
+#include "changingCPUdirectly/tracecache_tools.hh"
+
+using namespace std;
+
+// design-space sweep over a fetch trace file. Every combination of the
+// listed values is one geometry; the geometries are spread over a work
+// stealing thread pool and the results are written as one CSV table.
+// With --partitioned the geometries run one after another instead, each
+// with its sets split across the threads, for caches too large to run
+// one per thread.
+
+void usage(const char* prog){
+    fprintf(stderr,
+            "usage: %s [options] <fetch trace>\n"
+            "  --sets a,b,...    numbers of sets (default 16,32,64)\n"
+            "  --assoc a,b,...   associativities (default 1,2,4)\n"
+            "  --insns a,b,...   max instructions per line (default 16)\n"
+            "  --bbs a,b,...     max basic blocks per line (default 1)\n"
+            "  --policy a,b,...  replacement policies (default random)\n"
+            "  -j N              threads (default: one per core)\n"
+            "  -t N              geometries per task (default 4)\n"
+            "  -o FILE           write the table to FILE instead of stdout\n"
+            "  --partitioned     split each geometry's sets across the threads\n"
+            "  --sample N        only model 1 in N sets and estimate the hit rate\n"
+            "  --sample-hash     pick the sampled sets by hash, not every N-th\n",
+            prog);
+}
+
+// parses a comma separated list of positive integers
+int parseList(const char* arg, vector<int> &out){
+    out.clear();
+    const char* p = arg;
+    while(*p){
+        char* end;
+        long v = strtol(p, &end, 0);
+        if(end == p || v <= 0 || (*end != ',' && *end != '\0')){
+            return -1;
+        }
+        out.push_back(v);
+        p = *end ? end + 1 : end;
+    }
+    return out.empty() ? -1 : 0;
+}
+
+// parses a comma separated list of replacement policy names
+int parsePolicies(const char* arg, vector<int> &out){
+    out.clear();
+    string list(arg);
+    size_t start = 0;
+    while(start <= list.size()){
+        size_t end = list.find(',', start);
+        if(end == string::npos){
+            end = list.size();
+        }
+        int policy = tcReplPolicyFromName(list.substr(start, end - start).c_str());
+        // OPT needs the stream pre-scanned per geometry, which a sweep skips
+        if(policy < 0 || policy == TC_REPL_OPT){
+            return -1;
+        }
+        out.push_back(policy);
+        start = end + 1;
+    }
+    return 0;
+}
+
+template <class Reader>
+int runSweep(const char* path, vector<tcSweepPoint> &points, int numThreads,
+             int pointsPerTask, int partitioned, FILE* out){
+    Reader reader;
+    if(reader.open(path) != 0){
+        return 1;
+    }
+    fprintf(stderr, "sweeping %zu geometries over %lu fetches from %s\n",
+            points.size(), (unsigned long)reader.numRecords, path);
+    auto start = std::chrono::steady_clock::now();
+    if(partitioned){
+        for(size_t i = 0; i < points.size(); i++){
+            tcRunPartitioned(reader, points[i], numThreads);
+        }
+    }else{
+        tcRunSweep(reader, points, numThreads, pointsPerTask);
+    }
+    fprintf(stderr, "done in %.2fs\n", std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count());
+    tcPrintSweep(out, points);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    vector<int> sets = {16, 32, 64};
+    vector<int> assocs = {1, 2, 4};
+    vector<int> insns = {16};
+    vector<int> bbs = {1};
+    vector<int> policies = {TC_REPL_RANDOM};
+    int numThreads = 0;
+    int pointsPerTask = 4;
+    int partitioned = 0;
+    int sampleSets = 0;
+    int sampleHashed = 0;
+    const char* outPath = NULL;
+    const char* tracePath = NULL;
+
+    for(int i = 1; i < argc; i++){
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        int bad = 0;
+        if(arg[0] != '-'){
+            tracePath = arg;
+            continue;
+        }
+        if(strcmp(arg, "--partitioned") == 0){
+            partitioned = 1;
+            continue;
+        }
+        if(strcmp(arg, "--sample-hash") == 0){
+            sampleHashed = 1;
+            continue;
+        }
+        if(val == NULL){
+            usage(argv[0]);
+            return 1;
+        }
+        if(strcmp(arg, "--sets") == 0){
+            bad = parseList(val, sets);
+            for(size_t j = 0; j < sets.size(); j++){
+                bad |= (sets[j] & (sets[j] - 1)) != 0 ? -1 : 0;
+            }
+        }else if(strcmp(arg, "--assoc") == 0){
+            bad = parseList(val, assocs);
+        }else if(strcmp(arg, "--insns") == 0){
+            bad = parseList(val, insns);
+        }else if(strcmp(arg, "--bbs") == 0){
+            bad = parseList(val, bbs);
+            for(size_t j = 0; j < bbs.size(); j++){
+                bad |= bbs[j] > 31 ? -1 : 0;
+            }
+        }else if(strcmp(arg, "--policy") == 0){
+            bad = parsePolicies(val, policies);
+        }else if(strcmp(arg, "-j") == 0){
+            numThreads = atoi(val);
+        }else if(strcmp(arg, "-t") == 0){
+            pointsPerTask = atoi(val);
+            bad = pointsPerTask > 0 ? 0 : -1;
+        }else if(strcmp(arg, "--sample") == 0){
+            sampleSets = atoi(val);
+            bad = sampleSets > 0 ? 0 : -1;
+        }else if(strcmp(arg, "-o") == 0){
+            outPath = val;
+        }else{
+            bad = -1;
+        }
+        if(bad){
+            fprintf(stderr, "bad argument: %s %s\n", arg, val);
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if(tracePath == NULL){
+        usage(argv[0]);
+        return 1;
+    }
+    // set dueling couples the sets of a cache
+    for(size_t j = 0; partitioned && j < policies.size(); j++){
+        if(policies[j] == TC_REPL_DRRIP){
+            fprintf(stderr, "--partitioned does not support drrip\n");
+            return 1;
+        }
+    }
+
+    vector<tcSweepPoint> points;
+    for(int s : sets){
+        for(int a : assocs){
+            for(int n : insns){
+                for(int b : bbs){
+                    for(int p : policies){
+                        points.push_back(tcSweepPoint(s, a, n, b, p));
+                        points.back().sampleSets = sampleSets;
+                        points.back().sampleHashed = sampleHashed;
+                    }
+                }
+            }
+        }
+    }
+
+    FILE* out = stdout;
+    if(outPath != NULL && (out = fopen(outPath, "w")) == NULL){
+        fprintf(stderr, "cannot create %s\n", outPath);
+        return 1;
+    }
+
+    // compressed traces start with their own magic
+    char magic[8] = {0};
+    FILE* f = fopen(tracePath, "rb");
+    if(f != NULL){
+        fread(magic, 1, sizeof(magic), f);
+        fclose(f);
+    }
+    int ret;
+    if(memcmp(magic, "TCZTRACE", 8) == 0){
+        ret = runSweep<tcZTraceReader>(tracePath, points, numThreads, pointsPerTask,
+                                       partitioned, out);
+    }else{
+        ret = runSweep<tcTraceReader>(tracePath, points, numThreads, pointsPerTask,
+                                      partitioned, out);
+    }
+    if(out != stdout){
+        fclose(out);
+    }
+    return ret;
+}
@@ -2,210 +2,11 @@
 #include <cmath>
 #include <cstdlib>
 
-using namespace std;
-
-// represents one line in the trace cache
-class tcLine
-{
-  public:
-    // fields for accessing the tc line
-    int   tagAddr;
-    int   valid;
-    int   branchFlags;
-
-    int insnCount; // number of instructions in this line
-    int BBCount; // number of basic blocks in this line
-
-    // Constructor
-    tcLine() {
-      // set fields for accessing a tc line
-      this->tagAddr = 0;
-      this->valid = 0;
-      this->branchFlags = 0;
-      // set fields for building a trace
-      this->insnCount = 0;
-      this->BBCount = 0;
-    }
-};
-
-// represents the trace cache as an array of tcLine objects
-// This trace cache is currently built to support one branch instruction per
-// trace cache line.
-class traceCache
-{
-  public:
-    // parameters
-    int numSets; // number of sets in the cache
-    int assoc; // associativity of the cache
-
-    // fields describing the trace cache
-    tcLine* line;
-    int    size; // size of the cache in terms of lines
-    int    maxNumInsns; // max number of insns in one cache line
-    int    maxNumBBs = 1; // max number of basic blocks in one cache line
-
-    // fields for building a trace in the trace cache
-    int buildingTrace; // 1 = currently building a trace, 0 = otherwise
-    int buildLineIndex; // hold line # is trace cache that trace
-                        // is being built for
-    tcLine* buildLine; // used to hold stats on tc line currently being built
-
-    // Stats tracking
-    int globalHitCount;
-    int globalMissCount;
-
-    // Constructor
-    traceCache(int numSets, int assoc, int numInsns, int numBBs) {
-        // create an array of lines
-        line = new tcLine[assoc*numSets];
-        // set tc parameter
-        this->numSets = numSets;
-        this->assoc = assoc;
-        // set tc fields for describing trace cache
-        this->size = assoc*numSets;
-        this->maxNumInsns = numInsns;
-        this->maxNumBBs = numBBs;
-        // set tc fields for building a trace
-        this->buildingTrace = 0;
-        this->buildLineIndex = 0;
-        this->buildLine = new tcLine();
-        // set tc fields for stats tracking
-        this->globalHitCount = 0;
-        this->globalMissCount = 0;
-    }
-
-    // to be ran every instruction fetch
-    void tcInsnFetch(int fetchAddr, int isCondBranch, int branchPred){
-        int traceHit = 0;
-        // conditional branch instructions mark the beginning of a new trace
-        if(isCondBranch){
-            // complete the trace currently being built
-            if(this->buildingTrace){
-                this->completeTrace();
-            }
-
-            // look for the current address and prediction in the trace cache
-            traceHit = this->searchTraceCache(fetchAddr, branchPred);
-
-        }else{
-            if(this->buildingTrace){
-                // if there is a trace currently being built, add this instruction
-                this->buildTrace(fetchAddr, branchPred);
-            } // otherwise, do nothing
-        }
-    }
-
-    // returns 1 if hit, 0 if miss
-    int searchTraceCache(int fetchAddr, int branchPred){
-        // get the index bits from the fetch address
-        unsigned int mask = 0;
-        int index = 0;
-        int lowerSearchBound = 0;
-        int upperSearchBound = 0;
-        int numIndexBits = log2(this->numSets);
-        int hit = 0;
-        mask = (1 << numIndexBits) - 1;
-        index = fetchAddr & mask;
-
-        // find bounds of tc lines to access
-        lowerSearchBound = index * this->assoc;
-        upperSearchBound = lowerSearchBound + this->assoc;
+// the trace cache models shared with the gem5 simple CPU, and the
+// offline trace readers and drivers around them
+#include "changingCPUdirectly/tracecache_tools.hh"
 
-        // search all lines in appropriate set for hit
-        for(int i = lowerSearchBound; i < upperSearchBound; i++ ){
-            hit = searchTraceLine(fetchAddr, branchPred, i);
-            if(hit){ // if there is a hit, exit early
-                // log the hit statistics
-                this->logHitStats(fetchAddr, branchPred, i);
-                return 1;
-            }
-        }
-
-        // if there is no hit - we have a trace cache miss
-        this->logMissStats(fetchAddr, branchPred);
-
-        // on a miss, we begin building a new trace
-        // first, we figure out in which line the new trace should reside
-        this->buildLineIndex = this->selectBuildLineIndex(lowerSearchBound, upperSearchBound);
-        // then, we begin building the trace
-        this->buildTrace(fetchAddr, branchPred);
-        return 0;
-    }
-
-    void logHitStats(int fetchAddr, int branchPred, int i){
-        this->globalHitCount++;
-    }
-
-    void logMissStats(int fetchAddr, int branchPred){
-        this->globalMissCount++;
-    }
-
-    void buildTrace(int fetchAddr, int branchPred){
-        // if we are not currently building a trace, then this is the first
-        // instruction of the trace
-        if(this->buildingTrace == 0){
-            // set up trace
-            this->buildLine->tagAddr = fetchAddr; // save the PC
-            this->buildLine->branchFlags = branchPred;
-            this->buildLine->insnCount = 1;
-            this->buildLine->BBCount = 1;
-            // tell system we are now building a trace
-            this->buildingTrace = 1;
-        }
-        // if we are currently building a trace, then we need to add this insn to the trace
-        else{
-            // increment the instruction count of the line
-            this->buildLine->insnCount++;
-        }
-
-        // check whether the trace has reached its max capacity
-        if(this->buildLine->insnCount >= this->maxNumInsns){
-            completeTrace();
-        }
-    }
-
-    int searchTraceLine(int fetchAddr, int branchPred, int lineIndex){
-        // check for hit conditions
-        if((fetchAddr == this->line[lineIndex].tagAddr)&
-           (branchPred == this->line[lineIndex].branchFlags)&
-           (this->line[lineIndex].valid == 1)){
-               return 1; // line hit
-        }else{
-            return 0; // line miss
-        }
-    }
-
-    int selectBuildLineIndex(int lowerSearchBound, int upperSearchBound){
-        // first, see if there are any lines which are invalid
-        for(int i = lowerSearchBound; i < upperSearchBound; i++){
-            if(this->line[i].valid == 0){ // found an invalid line
-                return i;
-            }
-        }
-        // if there are no invalid cache lines, randomly pick a line to evict
-        return lowerSearchBound + (rand() % upperSearchBound);
-    }
-
-    void completeTrace(){
-        // copy all buildLine values to the correct line in the tc
-        this->line[this->buildLineIndex].tagAddr = this->buildLine->tagAddr;
-        this->line[this->buildLineIndex].branchFlags = this->buildLine->branchFlags;
-        this->line[this->buildLineIndex].insnCount = this->buildLine->insnCount;
-        this->line[this->buildLineIndex].BBCount = this->buildLine->BBCount;
-        this->line[this->buildLineIndex].valid = 1;
-
-        // clear out all buildLine values
-        this->buildLine->tagAddr = 9;
-        this->buildLine->branchFlags = 0;
-        this->buildLine->insnCount = 0;
-        this->buildLine->BBCount = 0;
-
-        // no longer building a trace
-        this->buildingTrace = 0;
-        this->buildLineIndex = 0;
-    }
-
-};
+using namespace std;
 
 // FOR TESTING PURPOSES
 
@@ -243,15 +44,185 @@ void printInsnStream(insn* insnStream, int size){
     }
 }
 
-void simulateInsnStream(insn* insnStream, int size, traceCache *tc){
+void simulateInsnStream(insn* insnStream, int size, tcModel *tc){
+    // hand the whole stream to the cache as one batch
+    vector<tcFetchRecord> records(size);
     for(int i = 0; i < size; i++){
-        tc->tcInsnFetch(insnStream[i].addr,insnStream[i].isCondBranch, insnStream[i].branchPred);
+        records[i].addr = insnStream[i].addr;
+        records[i].isCondBranch = insnStream[i].isCondBranch;
+        records[i].branchPred = insnStream[i].branchPred;
+    }
+    tc->tcInsnFetchBatch(records.data(), size);
+}
+
+// replays a fetch trace file, plain or compressed, against the
+// geometries BaseSimpleCPU models
+template <class Reader>
+int replayTraceFile(const char* path){
+    Reader reader;
+    if(reader.open(path) != 0){
+        return 1;
+    }
+    printf("replaying %lu fetches from %s\n", (unsigned long)reader.numRecords, path);
+
+    traceCacheBank bank(16, 1);
+    bank.addCache(64, 1);
+    bank.addCache(1, 64);
+    bank.addCache(32, 2);
+    bank.addCache(16, 4);
+    tcReplayTrace(reader, bank);
+
+    for(size_t i = 0; i < bank.caches.size(); i++){
+        tcModel *tc = bank.caches[i];
+        printf("%d sets x %d ways: trace miss count: %lu, trace hit count: %lu\n",
+               tc->numSets, tc->assoc, (unsigned long)tc->globalMissCount,
+               (unsigned long)tc->globalHitCount);
+    }
+    return 0;
+}
+
+// returns 1 and complains if traceCache would accept p
+int expectRejected(const char* name, const tcParams &p){
+    const char* why = p.check();
+    if(why == NULL){
+        printf("FAILED: %s is accepted\n", name);
+        return 1;
+    }
+    printf("rejected %s: %s\n", name, why);
+    return 0;
+}
+
+// a fixed stream over two thousand addresses, skewed so that low
+// addresses and the sets they map to see most of the traces
+void skewedStream(vector<tcFetchRecord> &records){
+    uint64_t x = 5;
+    for(size_t i = 0; i < records.size(); i++){
+        x = x*6364136223846793005ULL + 1442695040888963407ULL;
+        double u = (x >> 11) * (1.0/9007199254740992.0);
+        records[i].addr = (uint64_t)(2000*u*u)*4;
+        records[i].isCondBranch = (records[i].addr >> 2) % 8 == 0;
+        records[i].branchPred = (x >> 40) & 1;
+    }
+    // leaves the last trace looked up but not completed
+    records.back().isCondBranch = 1;
+}
+
+// what printDetailedStats writes for tc; empty without TC_DETAILED_STATS
+string detailedReport(tcModel* tc){
+    FILE* f = tmpfile();
+    if(f == NULL){
+        return "";
+    }
+    tc->printDetailedStats(f);
+    string report(ftell(f), '\0');
+    rewind(f);
+    if(fread(&report[0], 1, report.size(), f) != report.size()){
+        report.clear();
     }
+    fclose(f);
+    return report;
 }
 
-// just for basic sanity checks
-int main()
+// returns 1 and complains if a and b counted different results
+int expectSameStats(const char* name, tcModel* a, tcModel* b){
+    if(a->globalHitCount != b->globalHitCount
+       || a->globalMissCount != b->globalMissCount
+       || a->globalHitInsnCount != b->globalHitInsnCount
+       || a->globalPartialHitCount != b->globalPartialHitCount
+       || a->globalPartialInsnCount != b->globalPartialInsnCount
+       || detailedReport(a) != detailedReport(b)){
+        printf("FAILED: %s: %lu/%lu hits, %lu/%lu misses\n", name,
+               (unsigned long)a->globalHitCount, (unsigned long)b->globalHitCount,
+               (unsigned long)a->globalMissCount, (unsigned long)b->globalMissCount);
+        return 1;
+    }
+    printf("%s: %lu hits, %lu misses on both\n", name,
+           (unsigned long)a->globalHitCount, (unsigned long)a->globalMissCount);
+    return 0;
+}
+
+// the partitioned run must leave the same counters and lines as the
+// serial one, with and without partial matching, in both line layouts
+int checkPartitioned(const vector<tcFetchRecord> &records){
+    int failures = 0;
+    for(int cfg = 0; cfg < 4; cfg++){
+        tcParams p(256, 4, 16, 2);
+        p.replPolicy = TC_REPL_LRU;
+        p.partialMatch = cfg & 1;
+        p.layout = (cfg & 2) ? TC_LAYOUT_SOA : TC_LAYOUT_AOS;
+        traceCache serial(p);
+        traceCache parallel(p);
+        serial.tcInsnFetchBatch(records.data(), records.size());
+        tcPartitionedCache partitioned(&parallel, 3);
+        // in pieces, as the trace readers hand them over
+        for(size_t i = 0; i < records.size(); i += 1000){
+            partitioned.tcInsnFetchBatch(records.data() + i,
+                                         std::min<size_t>(1000, records.size() - i));
+        }
+        partitioned.finish();
+
+        char name[64];
+        snprintf(name, sizeof(name), "partitioned, %s, %s",
+                 p.partialMatch ? "partial" : "whole", (cfg & 2) ? "SOA" : "AOS");
+        int differs = expectSameStats(name, &serial, &parallel);
+        for(int i = 0; i < serial.size && !differs; i++){
+            tcLine a = serial.getLine(i);
+            tcLine b = parallel.getLine(i);
+            if(a.valid != b.valid || a.tagAddr != b.tagAddr
+               || a.branchFlags != b.branchFlags || a.insnCount != b.insnCount){
+                printf("FAILED: %s: line %d differs\n", name, i);
+                differs = 1;
+            }
+        }
+        failures += differs;
+    }
+    return failures;
+}
+
+// every member of a bank must count what a separate instance fed the
+// same stream counts
+int checkBank(const vector<tcFetchRecord> &records){
+    int geometries[5][3] = {{64, 1, TC_REPL_RANDOM}, {1, 64, TC_REPL_LRU},
+                            {32, 2, TC_REPL_RANDOM}, {16, 4, TC_REPL_LRU},
+                            {256, 4, TC_REPL_LRU}};
+    traceCacheBank bank(16, 2);
+    for(int g = 0; g < 5; g++){
+        bank.addCache(geometries[g][0], geometries[g][1], geometries[g][2]);
+    }
+    bank.tcInsnFetchBatch(records.data(), records.size());
+
+    int failures = 0;
+    for(int g = 0; g < 5; g++){
+        tcParams p(geometries[g][0], geometries[g][1], 16, 2);
+        p.replPolicy = geometries[g][2];
+        tcModel* alone = makeTraceCache(p);
+        alone->tcInsnFetchBatch(records.data(), records.size());
+        char name[64];
+        snprintf(name, sizeof(name), "bank, %d sets x %d ways", p.numSets, p.assoc);
+        failures += expectSameStats(name, bank.caches[g], alone);
+        delete alone;
+    }
+    return failures;
+}
+
+// just for basic sanity checks; with a fetch trace file as argument,
+// replays that file instead
+int main(int argc, char** argv)
 {
+    if(argc > 1){
+        // compressed traces start with their own magic
+        char magic[8] = {0};
+        FILE* f = fopen(argv[1], "rb");
+        if(f != NULL){
+            fread(magic, 1, sizeof(magic), f);
+            fclose(f);
+        }
+        if(memcmp(magic, "TCZTRACE", 8) == 0){
+            return replayTraceFile<tcZTraceReader>(argv[1]);
+        }
+        return replayTraceFile<tcTraceReader>(argv[1]);
+    }
+
     // initialize trace cache
     int numSets = 64;
     int assoc = 1;
@@ -272,11 +243,60 @@ int main()
     printf("trace cache size: %d\n", tc->size);
 
     for (int i = 0; i < tc->size; i++){
-        printf("tc at %d: %d\n", i, tc->line[i].insnCount);
+        printf("tc at %d: %d\n", i, tc->getLine(i).insnCount);
     }
 
-    printf("trace miss count: %d\n", tc->globalMissCount);
-    printf("trace hit count: %d\n", tc->globalHitCount);
-
-    return 0;
+    printf("trace miss count: %lu\n", (unsigned long)tc->globalMissCount);
+    printf("trace hit count: %lu\n", (unsigned long)tc->globalHitCount);
+    tc->printDetailedStats(stdout);
+
+    // hit and miss counts for every associativity up to 4 in one run
+    tcStackDistance *sd = new tcStackDistance(numSets, 4, numInsns, numBBs);
+    simulateInsnStream(insnStream, size, sd);
+    simulateInsnStream(insnStream, size, sd);
+    sd->printStackDistance();
+
+    // optimal replacement needs the whole stream scanned up front
+    tcNextUse *oracle = new tcNextUse(numInsns, numBBs);
+    for(int pass = 0; pass < 2; pass++){
+        for(int i = 0; i < size; i++){
+            oracle->scan(insnStream[i].addr, insnStream[i].isCondBranch, insnStream[i].branchPred);
+        }
+    }
+    oracle->finish();
+    tcParams optParams(numSets, assoc, numInsns, numBBs);
+    optParams.replPolicy = TC_REPL_OPT;
+    optParams.oracle = oracle;
+    traceCache *opt = new traceCache(optParams);
+    simulateInsnStream(insnStream, size, opt);
+    simulateInsnStream(insnStream, size, opt);
+    printf("optimal trace miss count: %lu\n", (unsigned long)opt->globalMissCount);
+    printf("optimal trace hit count: %lu\n", (unsigned long)opt->globalHitCount);
+
+    // option combinations traceCache cannot model are turned down by
+    // tcParams::check, which stays in NDEBUG builds unlike an assert
+    int failures = 0;
+    tcParams sampledSkew(numSets, 4, numInsns, numBBs);
+    sampledSkew.sampleSets = 4;
+    sampledSkew.indexFunc = TC_INDEX_SKEW;
+    failures += expectRejected("sampling with skewed indexing", sampledSkew);
+    tcParams sampledOPT = optParams;
+    sampledOPT.sampleSets = 4;
+    failures += expectRejected("sampling with OPT", sampledOPT);
+    tcParams longerOPT = optParams;
+    longerOPT.maxNumInsns = 2*numInsns;
+    failures += expectRejected("OPT with an oracle for shorter traces", longerOPT);
+    tcParams partialPath(numSets, 4, numInsns, 3);
+    partialPath.partialMatch = 1;
+    partialPath.indexFunc = TC_INDEX_PATH;
+    failures += expectRejected("partial matching with path indexing", partialPath);
+
+    // the bank and the partitioned mode are only shortcuts; both must
+    // reproduce the plain serial caches exactly
+    vector<tcFetchRecord> records(300007);
+    skewedStream(records);
+    failures += checkBank(records);
+    failures += checkPartitioned(records);
+
+    return failures ? 1 : 0;
 }